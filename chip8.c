@@ -1,22 +1,140 @@
+#define _GNU_SOURCE // sched_setaffinity and the CPU_* macros
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sched.h>
+#include <poll.h>
+#include <stddef.h>
 
 #include "SDL.h"
 
+// Build identification recorded with benchmark results, the Makefile passes the git commit
+#ifndef CHIP8_COMMIT
+#define CHIP8_COMMIT "unknown"
+#endif
+
+#if defined(__clang__)
+#define CHIP8_COMPILER "clang " __clang_version__
+#elif defined(__GNUC__)
+#define CHIP8_COMPILER "gcc " __VERSION__
+#else
+#define CHIP8_COMPILER "unknown"
+#endif
+
 typedef struct {
     SDL_Window *window;
     SDL_Renderer *renderer;
-
+    SDL_AudioSpec want, have;
+    SDL_AudioDeviceID dev; // 0 until the first sound, audio is brought up lazily
+    bool audio_failed;     // Don't retry opening audio every frame
 } sdl_t;
 
+// Where frames are presented
+typedef enum{
+    DISPLAY_SDL,      // SDL window
+    DISPLAY_TERMINAL, // ANSI terminal on stdout using braille cells, no window
+    DISPLAY_MOSAIC,   // Grid of many instances in one SDL window
+    DISPLAY_NONE,     // Headless, runs unthrottled with no output
+} display_backend_t;
+
+// Target platforms, picked per ROM by the library
+typedef enum{
+    PLATFORM_CHIP8,
+    PLATFORM_SUPERCHIP,
+    PLATFORM_XOCHIP,
+} platform_t;
+
+// Behaviour differences between platforms, OR'ed together in config_t.quirks
+enum{
+    QUIRK_VF_RESET     = 1 << 0, // 8XY1/8XY2/8XY3 clear VF
+    QUIRK_MEMORY       = 1 << 1, // FX55/FX65 increment I
+    QUIRK_DISPLAY_WAIT = 1 << 2, // DXYN waits for the next 60hz frame
+    QUIRK_CLIPPING     = 1 << 3, // Sprites clip at the screen edge instead of wrapping
+    QUIRK_SHIFTING     = 1 << 4, // 8XY6/8XYE shift VX in place, ignoring VY
+    QUIRK_JUMPING      = 1 << 5, // BNNN jumps to XNN + VX
+};
+
+// Default settings for each platform
+static const struct{
+    const char *name;
+    uint32_t quirks;
+    uint32_t insts_per_second;
+} platform_defaults[] = {
+    [PLATFORM_CHIP8]     = {"chip8",     QUIRK_VF_RESET | QUIRK_MEMORY | QUIRK_DISPLAY_WAIT | QUIRK_CLIPPING, 700},
+    [PLATFORM_SUPERCHIP] = {"superchip", QUIRK_CLIPPING | QUIRK_SHIFTING | QUIRK_JUMPING, 1800},
+    [PLATFORM_XOCHIP]    = {"xochip",    QUIRK_MEMORY, 60000},
+};
+
+// Interpreter cores, picked with --core and compared against each other with --lockstep
+typedef enum{
+    CORE_REFERENCE, // Plain switch interpreter
+    CORE_TABLE,     // Handler table dispatch with a faster DXYN
+    CORE_COUNT,
+} core_id_t;
+
+static const char *core_names[CORE_COUNT] = {
+    [CORE_REFERENCE] = "reference",
+    [CORE_TABLE]     = "table",
+};
+
+#define SESSION_MAX 16 // ROMs that can run side by side with --session
+
 // Emulator configuration
 typedef struct{
+    display_backend_t display;
+    const char *rom_name; // First non-option argument
+    platform_t platform;
+    uint32_t quirks;
+    uint32_t insts_per_second; // CHIP8 CPU clock rate
+    const char *library_dir; // ROM library to take per-ROM settings from
+    const char *pack_path; // ROM pack archive to load ROMs from instead of single files
     uint32_t window_width;
     uint32_t window_height;
     uint32_t fg_color;
     uint32_t bg_color;
     uint32_t scale_factor;
+    uint32_t mosaic_count; // Number of instances shown by the mosaic frontend
+    const char *session_roms[SESSION_MAX]; // ROMs run concurrently, each on its own thread
+    uint32_t session_count;
+    uint32_t session_gain[SESSION_MAX]; // Mixer volume of each session in percent
+    bool session_tiles; // Show sessions as tiles of one window instead of a window each
+    bool resume; // Restore the last session on start and keep autosaving it
+    uint32_t seed; // CXNN random number seed
+    const char *record_path; // Record keypad input to this replay file
+    const char *replay_path; // Play keypad input back from this replay file
+    const char *hash_path; // Write a chip8_t hash per frame to this file
+    const char *verify_path; // Compare chip8_t hashes against this reference hash stream
+    bool hash_instructions; // Hash after every instruction instead of every frame
+    core_id_t core; // Interpreter core used to run the ROM
+    bool lockstep; // Run lockstep_core next to core and compare after every instruction
+    core_id_t lockstep_core;
+    uint32_t profile_hz; // Guest PC sampling rate, 0 disables the profiler
+    const char *metrics_path; // Unix socket serving Prometheus metrics, NULL for none
+    int pin_emulation[SESSION_MAX]; // CPUs for emulation threads, sessions take them round robin
+    uint32_t pin_emulation_count;
+    int pin_render; // CPU for the thread presenting frames, -1 leaves it to the OS
+    int pin_audio; // CPU for the SDL audio callback thread, -1 leaves it to the OS
+    int realtime_priority; // SCHED_FIFO priority for emulation and audio threads, 0 keeps the default scheduler
+    const char *netplay_path; // Unix socket for two player netplay, NULL for local play
+    bool netplay_host; // Listen on netplay_path instead of connecting to it
+    bool startup_profile; // Report how long each startup stage took
+    uint32_t bench_frames; // Run this many frames headless as a benchmark and exit, 0 to run normally
+    const char *bench_history; // Append benchmark results to this JSON lines file
+    const char *bench_baseline; // Compare benchmark results against the latest matching entry here
+    double bench_tolerance; // Percent slowdown over the baseline counted as a regression
+    uint32_t square_wave_freq; // Frequency of square wave sound e.g. 440hz for middle A
+    uint32_t audio_sample_rate;
+    int16_t volume; // How loud or not is the sound
 } config_t;
 
 // Emulator states
@@ -32,6 +150,7 @@ typedef struct{
     uint8_t ram[4096]; // Memory in bytes
     bool display[64*32]; // Emulate original CHIP8 resolution
     uint16_t stack[12]; // Subroutine stack
+    uint8_t SP; // Stack pointer, index of the next free stack entry
     uint8_t V[16]; // Data registers V0-VF
     uint16_t I; // Index register
     uint16_t PC; // Program counter
@@ -39,27 +158,185 @@ typedef struct{
     uint8_t sound_timer; // Decrements at 60hz and plays tone when > 0
     bool keypad[16]; // Hex keypad 0x0-0xF
     const char *rom_name; // Currently running ROM
+    uint64_t rom_hash; // hash64 of the ROM image as loaded
+    uint64_t cycles; // Instructions executed since the ROM was loaded
+    uint32_t rng; // xorshift32 state for CXNN
+    bool draw; // Display changed since the start of the frame
+    uint32_t profile_pc; // PROFILE_BUSY | PC while inside emulate_frame, 0 between frames. Relaxed atomic
 } chip8_t;
 
+#define PROFILE_BUSY 0x10000
+#define PROFILE_MAX_HZ 100000 // Highest --profile sampling rate
+
+// Startup stages, timestamped for --startup-profile
+typedef enum{
+    STARTUP_MAIN,              // main() entered
+    STARTUP_ARGS,              // set_config_from_args
+    STARTUP_ROM_LOAD,          // init_chip8 ROM load
+    STARTUP_NETPLAY,           // Waiting for the netplay peer
+    STARTUP_SDL_INIT,          // SDL subsystems
+    STARTUP_WINDOW,            // Window creation
+    STARTUP_RENDERER,          // Renderer creation
+    STARTUP_FIRST_INSTRUCTION, // Emulation starts
+    STARTUP_FIRST_PRESENT,     // First frame on screen
+    STARTUP_STAGE_COUNT,
+} startup_stage_t;
+
+static const char *startup_stage_names[STARTUP_STAGE_COUNT] = {
+    [STARTUP_MAIN]              = "main",
+    [STARTUP_ARGS]              = "set_config_from_args",
+    [STARTUP_ROM_LOAD]          = "init_chip8 (ROM load)",
+    [STARTUP_NETPLAY]           = "netplay handshake",
+    [STARTUP_SDL_INIT]          = "SDL_Init",
+    [STARTUP_WINDOW]            = "window creation",
+    [STARTUP_RENDERER]          = "renderer creation",
+    [STARTUP_FIRST_INSTRUCTION] = "first instruction",
+    [STARTUP_FIRST_PRESENT]     = "first present",
+};
+
+// Performance counter value when each stage finished, 0 if not reached
+static uint64_t startup_times[STARTUP_STAGE_COUNT];
+
+void mark_startup(const startup_stage_t stage){
+    if (!startup_times[stage]) startup_times[stage] = SDL_GetPerformanceCounter();
+}
+
+// Terminal display, each braille cell covers 2x4 CHIP8 pixels
+#define TERM_COLS (64 / 2)
+#define TERM_ROWS (32 / 4)
+typedef struct{
+    uint8_t cells[TERM_ROWS * TERM_COLS]; // Dot patterns currently shown on the terminal
+    bool drawn; // False until the first full frame has been written
+} term_t;
+
+// Mosaic frontend, all instance framebuffers packed into one streaming texture
+#define MOSAIC_MAX_INSTANCES 1024
+typedef struct{
+    SDL_Texture *texture;
+    uint32_t cols; // Tiles per row
+    uint32_t rows; // Tiles per column
+} mosaic_t;
+
+// Background ROM loader states
+typedef enum{
+    LOADER_IDLE,
+    LOADER_BUSY, // Loader thread is reading the ROM
+    LOADER_DONE, // Result is ready to be swapped in by the main thread
+} loader_state_t;
+
+// Loads a new ROM into a fresh machine off the main thread, the running one keeps going until the swap
+typedef struct{
+    SDL_Thread *thread;
+    SDL_atomic_t state;  // loader_state_t, DONE is only published after result is written
+    char *request;       // ROM asked for by input (drop or hotkey) but not started yet
+    bool request_reload; // The request is the running ROM again (F5)
+    char *rom_name;      // ROM the loader thread is working on
+    bool from_image;     // The loader thread copies image instead of opening rom_name
+    char *current_name;  // ROM name the running machine points to, if it came from the loader
+    const uint8_t *image; // ROM pack image of the running ROM, NULL if it came from a file
+    size_t image_size;
+    chip8_t *result;     // Loaded machine, NULL if the load failed
+    config_t config;
+} rom_loader_t;
+
+// Counters an instance publishes for the metrics endpoint, updated once a frame by its emulation thread
+#define METRICS_FRAME_HISTORY 256 // Recent frame times kept for the percentiles
+#define METRICS_REQUEST_TIMEOUT_MS 1000 // How long a scrape client gets to send its request
+
+typedef struct{
+    SDL_SpinLock lock;        // Guards everything below
+    char rom_name[64];
+    uint64_t instructions;
+    uint64_t last_cycles;     // chip8_t.cycles at the last update
+    uint64_t frames_presented;
+    uint64_t frames_skipped;  // 60hz slots missed because a frame took longer than one
+    uint64_t cpu_ns;          // CPU time of the emulation thread
+    uint64_t frames;          // Frames recorded, frames % METRICS_FRAME_HISTORY is the next ring slot
+    double frame_seconds_sum;
+    double frame_seconds[METRICS_FRAME_HISTORY]; // Ring of recent frame times
+} instance_metrics_t;
+
+typedef struct{
+    SDL_Thread *thread;
+    SDL_atomic_t running;
+    int fd;                   // Listening socket
+    const char *path;
+    instance_metrics_t *instances[SESSION_MAX];
+    uint32_t count;
+} metrics_server_t;
+
+// One of several ROMs running at once. The session thread owns chip8, the main thread owns
+// SDL (windows, input, audio) and talks to the thread only through the atomics and the display copy
+typedef struct{
+    config_t config;        // Own copy, with the library settings for this ROM applied
+    chip8_t chip8;
+    SDL_Thread *thread;
+    SDL_atomic_t state;     // emulator_state_t asked for by the main thread
+    SDL_atomic_t keypad;    // Keypad bitmask from the main thread, bit N is key N
+    SDL_atomic_t sounding;  // Sound timer is running
+    SDL_atomic_t finished;  // Session thread has exited
+    SDL_SpinLock display_lock;
+    bool display[64*32];    // Last finished frame, guarded by display_lock
+    sdl_t sdl;              // Own window, unused when sessions are tiled
+    int cpu;                // CPU the session thread is pinned to, -1 for none
+    instance_metrics_t metrics;
+} session_t;
+
+// Smallest near-square grid that holds count tiles
+void mosaic_grid(const uint32_t count, uint32_t *cols, uint32_t *rows){
+    uint32_t c = 1;
+    while (c * c < count) c++;
+    *cols = c;
+    *rows = (count + c - 1) / c;
+}
+
 bool init_sdl(sdl_t *sdl, config_t config){
-    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER) != 0){
+    if (config.display == DISPLAY_TERMINAL || config.display == DISPLAY_NONE){
+        // No window, only timers and events (SIGINT still arrives as SDL_QUIT)
+        if (SDL_Init(SDL_INIT_TIMER | SDL_INIT_EVENTS) != 0){
+            SDL_Log("Could not initialize SDL subsystems!! %s\n", SDL_GetError());
+            return false;
+        }
+        mark_startup(STARTUP_SDL_INIT);
+        return true;
+    }
+
+    // Audio is left out here, init_audio brings it up the first time a ROM makes a sound
+    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER) != 0){
         SDL_Log("Could not initialize SDL subsystems!! %s\n", SDL_GetError());
         return false;
     }
+    mark_startup(STARTUP_SDL_INIT);
+
+    uint32_t width = config.window_width * config.scale_factor;
+    uint32_t height = config.window_height * config.scale_factor;
+    if (config.display == DISPLAY_MOSAIC){
+        // Shrink tiles as the grid grows so the window stays on screen
+        uint32_t cols, rows;
+        mosaic_grid(config.mosaic_count, &cols, &rows);
+        const uint32_t tile_scale = config.scale_factor / cols ? config.scale_factor / cols : 1;
+        width = cols * config.window_width * tile_scale;
+        height = rows * config.window_height * tile_scale;
+    }
 
     sdl->window = SDL_CreateWindow("CHIP-8 EMULATOR",  SDL_WINDOWPOS_CENTERED,  SDL_WINDOWPOS_CENTERED, 
-                                    config.window_width * config.scale_factor, config.window_height * config.scale_factor, 0);
+                                    width, height, 0);
 
     if (!sdl->window){
         SDL_Log("Could not create SDL window%s\n", SDL_GetError());
         return false;
     }
+    mark_startup(STARTUP_WINDOW);
 
     sdl->renderer = SDL_CreateRenderer(sdl->window, -1, SDL_RENDERER_ACCELERATED);
     if (!sdl->renderer){
         SDL_Log("Could not create SDL renderer%s\n", SDL_GetError());
         return false;
     }
+    mark_startup(STARTUP_RENDERER);
+
+    // ROMs dropped on the window are hot-swapped in
+    SDL_EventState(SDL_DROPFILE, SDL_ENABLE);
     return true;
 }
 
@@ -67,165 +344,4595 @@ bool init_sdl(sdl_t *sdl, config_t config){
 bool set_config_from_args(config_t *config, int argc, char **argv){
     
     //Set default
+    config->display = DISPLAY_SDL;
+    config->rom_name = NULL;
+    config->platform = PLATFORM_CHIP8;
+    config->quirks = platform_defaults[PLATFORM_CHIP8].quirks;
+    config->insts_per_second = platform_defaults[PLATFORM_CHIP8].insts_per_second;
+    config->library_dir = NULL;
+    config->pack_path = NULL;
     config->window_width = 64;
     config->window_height = 32;
     config->fg_color = 0xFFFFFFFF;
     config->bg_color = 0xFFFF00FF;
     config->scale_factor = 20;
+    config->mosaic_count = 1;
+    config->session_count = 0;
+    config->session_tiles = false;
+    config->startup_profile = false;
+    config->resume = false;
+    config->seed = (uint32_t)time(NULL);
+    config->record_path = NULL;
+    config->replay_path = NULL;
+    config->hash_path = NULL;
+    config->verify_path = NULL;
+    config->hash_instructions = false;
+    config->core = CORE_REFERENCE;
+    config->lockstep = false;
+    config->lockstep_core = CORE_TABLE;
+    config->profile_hz = 0;
+    config->metrics_path = NULL;
+    config->pin_emulation_count = 0;
+    config->pin_render = -1;
+    config->pin_audio = -1;
+    config->realtime_priority = 0;
+    config->netplay_path = NULL;
+    config->netplay_host = false;
+    config->bench_frames = 0;
+    config->bench_history = NULL;
+    config->bench_baseline = NULL;
+    config->bench_tolerance = 5.0;
+    config->square_wave_freq = 440; // 440hz for middle A
+    config->audio_sample_rate = 44100; // CD quality
+    config->volume = 3000; // INT16_MAX would be max volume
 
     //Override default with passed arguments
     for (int i = 1; i < argc; i++){
-        (void)argv[i];
+        if (strcmp(argv[i], "--terminal") == 0){
+            config->display = DISPLAY_TERMINAL;
+        }
+        else if (strcmp(argv[i], "--mosaic") == 0 && i + 1 < argc){
+            config->display = DISPLAY_MOSAIC;
+            config->mosaic_count = (uint32_t)strtoul(argv[++i], NULL, 10);
+            if (config->mosaic_count < 1 || config->mosaic_count > MOSAIC_MAX_INSTANCES){
+                SDL_Log("Mosaic instance count must be between 1 and %d\n", MOSAIC_MAX_INSTANCES);
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--session") == 0 && i + 1 < argc){
+            if (config->session_count == SESSION_MAX){
+                SDL_Log("At most %d sessions can run at once\n", SESSION_MAX);
+                return false;
+            }
+            config->session_gain[config->session_count] = 100;
+            config->session_roms[config->session_count++] = argv[++i];
+        }
+        else if (strcmp(argv[i], "--session-gain") == 0 && i + 1 < argc){
+            // Applies to the --session before it
+            if (!config->session_count){
+                SDL_Log("--session-gain has to follow a --session\n");
+                return false;
+            }
+            config->session_gain[config->session_count - 1] = (uint32_t)strtoul(argv[++i], NULL, 10);
+            if (config->session_gain[config->session_count - 1] > 400){
+                SDL_Log("Session gain must be between 0 and 400 percent\n");
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--session-tiles") == 0){
+            config->session_tiles = true;
+        }
+        else if (strcmp(argv[i], "--headless") == 0){
+            config->display = DISPLAY_NONE;
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc){
+            config->seed = (uint32_t)strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc){
+            config->record_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc){
+            config->replay_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--hash-stream") == 0 && i + 1 < argc){
+            config->hash_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--verify-stream") == 0 && i + 1 < argc){
+            config->verify_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--hash-instructions") == 0){
+            config->hash_instructions = true;
+        }
+        else if ((strcmp(argv[i], "--core") == 0 || strcmp(argv[i], "--lockstep") == 0) && i + 1 < argc){
+            const bool lockstep = strcmp(argv[i], "--lockstep") == 0;
+            const char *name = argv[++i];
+            core_id_t core = 0;
+            while (core < CORE_COUNT && strcmp(core_names[core], name) != 0) core++;
+            if (core == CORE_COUNT){
+                SDL_Log("Unknown core %s\n", name);
+                return false;
+            }
+            if (lockstep){
+                config->lockstep = true;
+                config->lockstep_core = core;
+            }
+            else{
+                config->core = core;
+            }
+        }
+        else if ((strcmp(argv[i], "--netplay-host") == 0 || strcmp(argv[i], "--netplay-join") == 0) && i + 1 < argc){
+            config->netplay_host = strcmp(argv[i], "--netplay-host") == 0;
+            config->netplay_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--pin-emu") == 0 && i + 1 < argc){
+            // Comma separated CPU list, e.g. 2,3,4,5
+            config->pin_emulation_count = 0;
+            for (char *cpu = argv[++i], *end; *cpu; cpu = *end ? end + 1 : end){
+                const unsigned long n = strtoul(cpu, &end, 10);
+                if (end == cpu || (*end && *end != ',') || n >= CPU_SETSIZE || config->pin_emulation_count == SESSION_MAX){
+                    SDL_Log("Bad CPU list %s\n", argv[i]);
+                    return false;
+                }
+                config->pin_emulation[config->pin_emulation_count++] = (int)n;
+            }
+        }
+        else if ((strcmp(argv[i], "--pin-render") == 0 || strcmp(argv[i], "--pin-audio") == 0) && i + 1 < argc){
+            int *pin = strcmp(argv[i], "--pin-render") == 0 ? &config->pin_render : &config->pin_audio;
+            *pin = (int)strtol(argv[++i], NULL, 10);
+            if (*pin < 0 || *pin >= CPU_SETSIZE){
+                SDL_Log("CPU must be between 0 and %d\n", CPU_SETSIZE - 1);
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--realtime") == 0 && i + 1 < argc){
+            config->realtime_priority = (int)strtol(argv[++i], NULL, 10);
+            if (config->realtime_priority < sched_get_priority_min(SCHED_FIFO) ||
+                config->realtime_priority > sched_get_priority_max(SCHED_FIFO)){
+                SDL_Log("SCHED_FIFO priority must be between %d and %d\n",
+                        sched_get_priority_min(SCHED_FIFO), sched_get_priority_max(SCHED_FIFO));
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc){
+            config->metrics_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc){
+            config->profile_hz = (uint32_t)strtoul(argv[++i], NULL, 10);
+            // nanosleep can't pace the sampler much faster than this, past it the thread would just spin
+            if (config->profile_hz > PROFILE_MAX_HZ){
+                SDL_Log("Profile rate must be at most %d Hz\n", PROFILE_MAX_HZ);
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc){
+            config->bench_frames = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--bench-history") == 0 && i + 1 < argc){
+            config->bench_history = argv[++i];
+        }
+        else if (strcmp(argv[i], "--bench-baseline") == 0 && i + 1 < argc){
+            config->bench_baseline = argv[++i];
+        }
+        else if (strcmp(argv[i], "--bench-tolerance") == 0 && i + 1 < argc){
+            config->bench_tolerance = strtod(argv[++i], NULL);
+        }
+        else if (strcmp(argv[i], "--resume") == 0){
+            config->resume = true;
+        }
+        else if (strcmp(argv[i], "--startup-profile") == 0){
+            config->startup_profile = true;
+        }
+        else if (strcmp(argv[i], "--library") == 0 && i + 1 < argc){
+            config->library_dir = argv[++i];
+        }
+        else if (strcmp(argv[i], "--pack") == 0 && i + 1 < argc){
+            config->pack_path = argv[++i];
+        }
+        else if (strncmp(argv[i], "--", 2) == 0){
+            SDL_Log("Unknown option %s\n", argv[i]);
+            return false;
+        }
+        else if (!config->rom_name){
+            config->rom_name = argv[i];
+        }
     }
 
     return true;
 }
 
-void final_cleanup(const sdl_t sdl){
-    SDL_DestroyRenderer(sdl.renderer);
-    SDL_DestroyWindow(sdl.window);
-    SDL_Quit();
+// Asynchronous log for runtime paths. log_event only copies a fixed size record into the calling
+// thread's ring, a drainer thread does the formatting and the SDL_Log I/O. A record is a format
+// string literal, an optional short string copied in and up to three integers: with text the
+// first conversion is its %s, the integers follow as %lld style conversions
+#define LOG_RING_SIZE 128  // Records per thread, a power of two
+#define LOG_MAX_THREADS 32 // Threads beyond this log synchronously
+#define LOG_TEXT_SIZE 64
+
+typedef struct{
+    const char *format;
+    long long args[3];
+    char text[LOG_TEXT_SIZE];
+    bool has_text;
+} log_record_t;
+
+// Single producer: the owning thread advances head, whoever holds drain_lock advances tail
+typedef struct{
+    log_record_t records[LOG_RING_SIZE];
+    uint32_t head;
+    uint32_t tail;
+    uint32_t dropped; // Records lost to a full ring, logging never waits
+} log_ring_t;
+
+static struct{
+    log_ring_t rings[LOG_MAX_THREADS];
+    uint32_t ring_count; // Rings handed out, may count past LOG_MAX_THREADS
+    SDL_Thread *thread;
+    SDL_atomic_t running;
+    SDL_SpinLock drain_lock; // The drainer thread and the last drain in stop_log or a late log_event
+} async_log;
+
+static __thread log_ring_t *log_thread_ring;
+
+void format_log_record(const log_record_t *record){
+    char line[256];
+    if (record->has_text){
+        snprintf(line, sizeof line, record->format, record->text, record->args[0], record->args[1], record->args[2]);
+    }
+    else{
+        snprintf(line, sizeof line, record->format, record->args[0], record->args[1], record->args[2]);
+    }
+    SDL_Log("%s", line);
 }
 
-// Clear screen / SDL Window to background color
-void clear_screen(const sdl_t sdl, const config_t config){
-    const uint32_t r = (config.bg_color >> 24) & 0xFF;
-    const uint32_t g = (config.bg_color >> 16) & 0xFF;
-    const uint32_t b = (config.bg_color >> 8) & 0xFF;
-    const uint32_t a = (config.bg_color >> 0) & 0xFF;
-    SDL_SetRenderDrawColor(sdl.renderer, r, g, b, a);
-    SDL_RenderClear(sdl.renderer);
+void drain_log(void){
+    SDL_AtomicLock(&async_log.drain_lock);
+    uint32_t count = __atomic_load_n(&async_log.ring_count, __ATOMIC_ACQUIRE);
+    if (count > LOG_MAX_THREADS) count = LOG_MAX_THREADS;
+
+    for (uint32_t i = 0; i < count; i++){
+        log_ring_t *ring = &async_log.rings[i];
+        const uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (uint32_t tail = ring->tail; tail != head; tail++){
+            format_log_record(&ring->records[tail % LOG_RING_SIZE]);
+            __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+        }
+        const uint32_t dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped) SDL_Log("%u log records dropped\n", dropped);
+    }
+    SDL_AtomicUnlock(&async_log.drain_lock);
 }
 
-void update_screen(const sdl_t sdl) {
-    SDL_RenderPresent(sdl.renderer);
+void log_event(const char *format, const char *text, const long long a, const long long b, const long long c){
+    log_record_t record = {.format = format, .args = {a, b, c}, .has_text = text != NULL};
+    if (text) snprintf(record.text, sizeof record.text, "%s", text);
+
+    log_ring_t *ring = log_thread_ring;
+    if (!ring && SDL_AtomicGet(&async_log.running)){
+        const uint32_t index = __atomic_fetch_add(&async_log.ring_count, 1, __ATOMIC_ACQ_REL);
+        if (index < LOG_MAX_THREADS) ring = log_thread_ring = &async_log.rings[index];
+    }
+    // Before the drainer starts, after it stops and for threads without a ring
+    if (!ring || !SDL_AtomicGet(&async_log.running)){
+        format_log_record(&record);
+        return;
+    }
+
+    const uint32_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SIZE){
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    ring->records[head % LOG_RING_SIZE] = record;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+
+    // stop_log may have done its last drain between the check above and the push, print it here instead
+    if (!SDL_AtomicGet(&async_log.running)) drain_log();
 }
 
-void handle_input(chip8_t *chip8) {
-    SDL_Event event;
+int log_thread(void *data){
+    (void)data;
+    const struct timespec interval = {.tv_nsec = 5000000};
+    while (SDL_AtomicGet(&async_log.running)){
+        drain_log();
+        nanosleep(&interval, NULL);
+    }
+    return 0;
+}
 
-    while(SDL_PollEvent(&event)){
-        switch (event.type)
-        {
-        case SDL_QUIT:
-            chip8->state = QUIT; // Quit main emulator loop
-            return;
-        case SDL_KEYUP:
-            break;
-        case SDL_KEYDOWN:
-            switch(event.key.keysym.sym){
-                case SDLK_ESCAPE:
-                    chip8->state = QUIT;
-                    return;
-                case SDLK_SPACE:
-                    // Spacebar
-                    if (chip8->state == RUNNING){
-                        chip8->state = PAUSED;
-                        puts("==== PAUSED ====");
-                    }
-                    else{
-                       chip8->state = RUNNING; 
-                       puts("==== RUNNING ====");
-                    }
-                default:
-                    break;
-            }
-            break;
-        default:
-            break;
+// Flushes what is still queued, registered with atexit so every exit path gets the tail of the log
+void stop_log(void){
+    if (!async_log.thread) return;
+    SDL_AtomicSet(&async_log.running, 0);
+    SDL_WaitThread(async_log.thread, NULL);
+    async_log.thread = NULL;
+    drain_log();
+}
+
+void start_log(void){
+    SDL_AtomicSet(&async_log.running, 1);
+    async_log.thread = SDL_CreateThread(log_thread, "log", NULL);
+    if (!async_log.thread){
+        SDL_Log("Could not start the log thread, logging synchronously! %s\n", SDL_GetError());
+        SDL_AtomicSet(&async_log.running, 0);
+        return;
+    }
+    atexit(stop_log);
+}
+
+// CPUs the process was started with, threads that aren't pinned go back to these
+static cpu_set_t process_affinity;
+static bool process_affinity_saved;
+
+// Called from main before any thread is tuned
+void save_process_affinity(void){
+    process_affinity_saved = sched_getaffinity(0, sizeof process_affinity, &process_affinity) == 0;
+}
 
+// Pin the calling thread to cpu and move it to SCHED_FIFO if priority is set. Threads inherit both from
+// whoever created them, so cpu -1 and priority 0 put the thread back on the process CPUs and the default
+// scheduler. Either can fail without the right privileges or CPUs, the thread then just carries on as it was
+void tune_thread(const char *name, const int cpu, const int priority){
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (cpu >= 0) CPU_SET(cpu, &set);
+    else if (process_affinity_saved) set = process_affinity;
+    char reason[LOG_TEXT_SIZE];
+    if ((cpu >= 0 || process_affinity_saved) && sched_setaffinity(0, sizeof set, &set) != 0){
+        if (cpu >= 0) snprintf(reason, sizeof reason, "%s thread to CPU %d: %s", name, cpu, strerror(errno));
+        else snprintf(reason, sizeof reason, "%s thread to the process CPUs: %s", name, strerror(errno));
+        log_event("Could not set the CPU affinity of the %s\n", reason, 0, 0, 0);
+    }
+
+    if (priority){
+        const struct sched_param param = {.sched_priority = priority};
+        if (sched_setscheduler(0, SCHED_FIFO, &param) != 0){
+            snprintf(reason, sizeof reason, "%s thread SCHED_FIFO %d: %s", name, priority, strerror(errno));
+            log_event("Could not give the %s, keeping the default scheduler\n", reason, 0, 0, 0);
         }
     }
+    else if (sched_getscheduler(0) != SCHED_OTHER){
+        const struct sched_param param = {.sched_priority = 0};
+        sched_setscheduler(0, SCHED_OTHER, &param);
+    }
 }
 
-bool init_chip8(chip8_t *chip8, const config_t config, const char rom_name[]){
-    const uint32_t entry_point = 0x200; // CHIP8 roms will be loaded to 0x200
-    const uint8_t font[] = {
-        0xF0, 0x90, 0x90, 0x90, 0xF0,   // 0   
-        0x20, 0x60, 0x20, 0x20, 0x70,   // 1  
-        0xF0, 0x10, 0xF0, 0x80, 0xF0,   // 2 
-        0xF0, 0x10, 0xF0, 0x10, 0xF0,   // 3
-        0x90, 0x90, 0xF0, 0x10, 0x10,   // 4    
-        0xF0, 0x80, 0xF0, 0x10, 0xF0,   // 5
-        0xF0, 0x80, 0xF0, 0x90, 0xF0,   // 6
-        0xF0, 0x10, 0x20, 0x40, 0x40,   // 7
-        0xF0, 0x90, 0xF0, 0x90, 0xF0,   // 8
-        0xF0, 0x90, 0xF0, 0x10, 0xF0,   // 9
-        0xF0, 0x90, 0xF0, 0x90, 0x90,   // A
-        0xE0, 0x90, 0xE0, 0x90, 0xE0,   // B
-        0xF0, 0x80, 0x80, 0x80, 0xF0,   // C
-        0xE0, 0x90, 0x90, 0x90, 0xE0,   // D
-        0xF0, 0x80, 0xF0, 0x80, 0xF0,   // E
-        0xF0, 0x80, 0xF0, 0x80, 0x80,   // F
+// Called at the top of every audio callback, the thread only exists once SDL has opened the device.
+// It is created by the already tuned main thread, so it is always retuned, to the defaults without --pin-audio
+void tune_audio_thread(const config_t *config){
+    static bool tuned = false; // Only touched by the audio thread
+    if (tuned) return;
+    tuned = true;
+    tune_thread("audio", config->pin_audio, config->realtime_priority);
+}
+
+// SDL audio callback, fills stream with a square wave
+void audio_callback(void *userdata, uint8_t *stream, int len){
+    const config_t *config = userdata;
+    tune_audio_thread(config);
+    int16_t *audio_data = (int16_t *)stream;
+    static uint32_t running_sample_index = 0;
+    const int32_t square_wave_period = config->audio_sample_rate / config->square_wave_freq;
+    const int32_t half_square_wave_period = square_wave_period / 2;
+
+    // Filling 2 bytes at a time (int16_t)
+    for (int i = 0; i < len / 2; i++){
+        audio_data[i] = ((running_sample_index++ / half_square_wave_period) % 2) ?
+                        config->volume : -config->volume;
+    }
+}
+
+// Mixer for concurrent sessions, every sounding session adds its square wave to one audio stream
+#define MIXER_BLOCK 256 // Samples mixed per pass, sized for the on-stack accumulator
+
+typedef struct{
+    SDL_atomic_t *sounding; // The session's sound flag, the only state shared with its thread
+    int32_t level;          // Square wave amplitude with the session gain applied
+    uint32_t half_period;   // Samples per half wave
+    uint32_t phase;         // Samples into the current half wave, audio thread only
+    bool high;              // Current half wave is positive, audio thread only
+} mixer_channel_t;
+
+typedef struct{
+    mixer_channel_t channels[SESSION_MAX];
+    uint32_t count;
+    const config_t *config; // Thread tuning options for the audio thread
+} mixer_t;
+
+// Set up a channel, gain is Q15 fixed point (32768 is unity)
+void mixer_add_channel(mixer_t *mixer, SDL_atomic_t *sounding, const config_t *config, const uint32_t gain){
+    const uint32_t half_period = config->audio_sample_rate / config->square_wave_freq / 2;
+    mixer->channels[mixer->count++] = (mixer_channel_t){
+        .sounding = sounding,
+        .level = (int32_t)(((int64_t)config->volume * gain) >> 15),
+        .half_period = half_period ? half_period : 1,
     };
+}
 
-    // Load Font
-    memcpy(&chip8->ram[0], font, sizeof(font));
+// SDL audio callback for the mixer. Channels are accumulated in 32 bits a run of equal samples at a
+// time, so the inner loops are plain adds the compiler vectorizes, then saturated down to 16 bits
+void mixer_callback(void *userdata, uint8_t *stream, int len){
+    mixer_t *mixer = userdata;
+    tune_audio_thread(mixer->config);
+    int16_t *audio_data = (int16_t *)stream;
+    const int samples = len / 2;
+    int32_t mix[MIXER_BLOCK];
 
-    // Open ROM file
-    FILE *rom = fopen(rom_name, "rb");
-    if (!rom){
-        SDL_Log("ROM file invalid or does not exist\n");
-        return false;
+    for (int start = 0; start < samples; start += MIXER_BLOCK){
+        const int count = samples - start < MIXER_BLOCK ? samples - start : MIXER_BLOCK;
+        memset(mix, 0, count * sizeof *mix);
+
+        for (uint32_t c = 0; c < mixer->count; c++){
+            mixer_channel_t *channel = &mixer->channels[c];
+            if (!SDL_AtomicGet(channel->sounding)) continue;
+
+            for (int i = 0; i < count;){
+                const uint32_t left = channel->half_period - channel->phase;
+                const int run = left < (uint32_t)(count - i) ? (int)left : count - i;
+                const int32_t value = channel->high ? channel->level : -channel->level;
+                for (int j = i; j < i + run; j++) mix[j] += value;
+
+                i += run;
+                channel->phase += run;
+                if (channel->phase == channel->half_period){
+                    channel->phase = 0;
+                    channel->high = !channel->high;
+                }
+            }
+        }
+
+        for (int i = 0; i < count; i++){
+            audio_data[start + i] = mix[i] > INT16_MAX ? INT16_MAX : mix[i] < INT16_MIN ? INT16_MIN : mix[i];
+        }
     }
-    fseek(rom, 0, SEEK_END);
-    const size_t rom_size = ftell(rom);
-    const size_t max_size = sizeof chip8->ram - entry_point;
-    rewind(rom); 
+}
 
-    if (rom_size > max_size){
-        SDL_Log("ROM file is too big\n");
+// Open the audio device, deferred until sound_timer first goes non-zero since device probing is slow.
+// The callback gets userdata, audio_callback takes the config and mixer_callback a mixer_t
+bool init_audio(sdl_t *sdl, const config_t *config, SDL_AudioCallback callback, void *userdata){
+    if (sdl->dev) return true;
+    if (sdl->audio_failed) return false;
+
+    sdl->want = (SDL_AudioSpec){
+        .freq = config->audio_sample_rate, // 44100hz "CD" quality
+        .format = AUDIO_S16SYS,            // Signed 16 bit little endian
+        .channels = 1,                     // Mono, 1 channel
+        .samples = 512,
+        .callback = callback,
+        .userdata = userdata,
+    };
+
+    if (SDL_InitSubSystem(SDL_INIT_AUDIO) != 0){
+        SDL_Log("Could not initialize SDL audio %s\n", SDL_GetError());
+        sdl->audio_failed = true;
         return false;
     }
 
-    // Load ROM
-    // Read in ram from entry point the rom_size
-    if (fread(&chip8->ram[entry_point], rom_size, 1, rom) !=1){
-        SDL_Log("Could not read ROM file into CHIP8 memory\n");
+    sdl->dev = SDL_OpenAudioDevice(NULL, 0, &sdl->want, &sdl->have, 0);
+    if (sdl->dev == 0 || sdl->want.format != sdl->have.format || sdl->want.channels != sdl->have.channels){
+        SDL_Log("Could not get an audio device %s\n", SDL_GetError());
+        if (sdl->dev) SDL_CloseAudioDevice(sdl->dev);
+        sdl->dev = 0;
+        sdl->audio_failed = true;
         return false;
     }
+    return true;
+}
 
-    fclose(rom);
+void close_window(sdl_t *sdl){
+    SDL_DestroyRenderer(sdl->renderer);
+    SDL_DestroyWindow(sdl->window);
+    sdl->renderer = NULL;
+    sdl->window = NULL;
+}
 
-    // Set defauts
-    chip8->state = RUNNING;
-    chip8->PC = entry_point; //Start program counter at ROM entry point
-    chip8->rom_name = rom_name;
+void final_cleanup(const sdl_t sdl){
+    if (sdl.dev) SDL_CloseAudioDevice(sdl.dev);
+    if (sdl.renderer) SDL_DestroyRenderer(sdl.renderer);
+    if (sdl.window) SDL_DestroyWindow(sdl.window);
+    SDL_Quit();
+}
 
-    return true;
+// Clear the terminal and hide the cursor before the first frame
+void init_terminal(term_t *term){
+    memset(term, 0, sizeof *term);
+    fputs("\x1b[2J\x1b[?25l", stdout);
+    fflush(stdout);
 }
 
-int main(int argc, char **argv){
+// Park the cursor below the picture and show it again
+void close_terminal(void){
+    printf("\x1b[%d;1H\x1b[?25h", TERM_ROWS + 1);
+    fflush(stdout);
+}
 
-    // Initialize emulator config
-    config_t config = {0};  
-    if (!set_config_from_args(&config, argc, argv)) exit(EXIT_FAILURE);
+// Braille dot bit for each pixel of a 2x4 cell, indexed [row][col]
+static const uint8_t braille_dots[4][2] = {
+    {0x01, 0x08},
+    {0x02, 0x10},
+    {0x04, 0x20},
+    {0x40, 0x80},
+};
 
-    // Initialize SDL
-    sdl_t sdl = {0};
-    if (!init_sdl(&sdl, config)) exit(EXIT_FAILURE);
+// Write only the braille cells that changed since the last frame
+void update_terminal(term_t *term, const chip8_t *chip8){
+    // Worst case every cell changes: cursor escape + 3 byte UTF-8 glyph per cell
+    char out[TERM_ROWS * TERM_COLS * 16];
+    size_t len = 0;
 
-    // Initialize CHIP8 machine
-    chip8_t chip8 = {0};
-    const char *rom_name = argv[1];
-    if (!init_chip8(&chip8, config, rom_name)) exit(EXIT_FAILURE);
+    for (int row = 0; row < TERM_ROWS; row++){
+        bool cursor_here = false; // Cursor already sits on this cell after the previous write
 
-    // Initialize screen clear to background color
-    clear_screen(sdl, config);
+        for (int col = 0; col < TERM_COLS; col++){
+            uint8_t dots = 0;
+            for (int dy = 0; dy < 4; dy++){
+                const bool *line = &chip8->display[(row * 4 + dy) * 64 + col * 2];
+                if (line[0]) dots |= braille_dots[dy][0];
+                if (line[1]) dots |= braille_dots[dy][1];
+            }
 
+            uint8_t *cell = &term->cells[row * TERM_COLS + col];
+            if (term->drawn && *cell == dots){
+                cursor_here = false;
+                continue;
+            }
+            *cell = dots;
 
-    // Main emulator loop
-    while(chip8.state != QUIT){
+            if (!cursor_here){
+                len += snprintf(&out[len], sizeof out - len, "\x1b[%d;%dH", row + 1, col + 1);
+            }
 
-        // Handle user input
-        handle_input(&chip8);
-        // Delay for 60FPS (16.67 ms)
-        SDL_Delay(16);
-        // Update window with changes
-        update_screen(sdl);
+            // U+2800 + dots encoded as UTF-8
+            out[len++] = (char)0xE2;
+            out[len++] = (char)(0xA0 | (dots >> 6));
+            out[len++] = (char)(0x80 | (dots & 0x3F));
+            cursor_here = true;
+        }
+    }
+    term->drawn = true;
+
+    if (len){
+        fwrite(out, 1, len, stdout);
+        fflush(stdout);
+    }
+}
+
+// Clear screen / SDL Window to background color
+void clear_screen(const sdl_t sdl, const config_t config){
+    const uint32_t r = (config.bg_color >> 24) & 0xFF;
+    const uint32_t g = (config.bg_color >> 16) & 0xFF;
+    const uint32_t b = (config.bg_color >> 8) & 0xFF;
+    const uint32_t a = (config.bg_color >> 0) & 0xFF;
+    SDL_SetRenderDrawColor(sdl.renderer, r, g, b, a);
+    SDL_RenderClear(sdl.renderer);
+}
+
+void update_screen(const sdl_t sdl, const config_t config, const chip8_t *chip8) {
+    SDL_Rect rect = {.x = 0, .y = 0, .w = config.scale_factor, .h = config.scale_factor};
+
+    // Grab color values to draw
+    const uint8_t fg_r = (config.fg_color >> 24) & 0xFF;
+    const uint8_t fg_g = (config.fg_color >> 16) & 0xFF;
+    const uint8_t fg_b = (config.fg_color >> 8) & 0xFF;
+    const uint8_t fg_a = (config.fg_color >> 0) & 0xFF;
+
+    const uint8_t bg_r = (config.bg_color >> 24) & 0xFF;
+    const uint8_t bg_g = (config.bg_color >> 16) & 0xFF;
+    const uint8_t bg_b = (config.bg_color >> 8) & 0xFF;
+    const uint8_t bg_a = (config.bg_color >> 0) & 0xFF;
+
+    // Loop through display pixels, draw a rectangle per pixel to the SDL window
+    for (uint32_t i = 0; i < sizeof chip8->display; i++){
+        rect.x = (i % config.window_width) * config.scale_factor;
+        rect.y = (i / config.window_width) * config.scale_factor;
+
+        if (chip8->display[i]){
+            SDL_SetRenderDrawColor(sdl.renderer, fg_r, fg_g, fg_b, fg_a);
+        }
+        else{
+            SDL_SetRenderDrawColor(sdl.renderer, bg_r, bg_g, bg_b, bg_a);
+        }
+        SDL_RenderFillRect(sdl.renderer, &rect);
+    }
+
+    SDL_RenderPresent(sdl.renderer);
+}
+
+bool init_mosaic(mosaic_t *mosaic, const sdl_t sdl, const config_t config){
+    mosaic_grid(config.mosaic_count, &mosaic->cols, &mosaic->rows);
+    mosaic->texture = SDL_CreateTexture(sdl.renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING,
+                                        mosaic->cols * config.window_width, mosaic->rows * config.window_height);
+    if (!mosaic->texture){
+        SDL_Log("Could not create mosaic texture %s\n", SDL_GetError());
+        return false;
+    }
+    return true;
+}
+
+// Write every instance into its tile of the shared texture, then present once
+void update_mosaic(const mosaic_t *mosaic, const sdl_t sdl, const config_t config,
+                   const chip8_t chip8s[], const uint32_t count){
+    void *pixels;
+    int pitch;
+    if (SDL_LockTexture(mosaic->texture, NULL, &pixels, &pitch) != 0){
+        SDL_Log("Could not lock mosaic texture %s\n", SDL_GetError());
+        return;
+    }
+
+    // Locked texture contents are undefined, so every tile is written, empty ones with background
+    for (uint32_t tile = 0; tile < mosaic->cols * mosaic->rows; tile++){
+        const uint32_t tile_x = (tile % mosaic->cols) * config.window_width;
+        const uint32_t tile_y = (tile / mosaic->cols) * config.window_height;
+
+        for (uint32_t y = 0; y < config.window_height; y++){
+            uint32_t *row = (uint32_t *)((uint8_t *)pixels + (tile_y + y) * pitch) + tile_x;
+
+            if (tile >= count){
+                for (uint32_t x = 0; x < config.window_width; x++) row[x] = config.bg_color;
+                continue;
+            }
+
+            const bool *line = &chip8s[tile].display[y * config.window_width];
+            for (uint32_t x = 0; x < config.window_width; x++){
+                row[x] = line[x] ? config.fg_color : config.bg_color;
+            }
+        }
+    }
+
+    SDL_UnlockTexture(mosaic->texture);
+    SDL_RenderCopy(sdl.renderer, mosaic->texture, NULL, NULL);
+    SDL_RenderPresent(sdl.renderer);
+}
+
+// Fast non-cryptographic 64 bit hash, 8 bytes per step (host byte order)
+uint64_t hash64(const void *data, size_t len, uint64_t seed){
+    const uint64_t prime = 0x9E3779B97F4A7C15ull;
+    const uint8_t *p = data;
+    uint64_t h = seed ^ (len * prime);
+
+    for (; len >= 8; p += 8, len -= 8){
+        uint64_t k;
+        memcpy(&k, p, 8);
+        k *= 0xBF58476D1CE4E5B9ull;
+        k ^= k >> 31;
+        h = (h ^ k) * prime;
+    }
+    if (len){
+        uint64_t k = 0;
+        memcpy(&k, p, len);
+        h = (h ^ (k * 0xBF58476D1CE4E5B9ull)) * prime;
+    }
+
+    // Final avalanche
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+// LZ4-style block codec: sequences of [token][literal length][literals][offset][match length].
+// Token high nibble is the literal count, low nibble the match length - 4, 15 means more length bytes follow.
+// The last sequence is literals only.
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+
+// Worst case compressed size for len input bytes
+size_t lz_bound(const size_t len){
+    return len + len / 255 + 16;
+}
+
+static uint8_t *lz_put_length(uint8_t *op, size_t len){
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+static uint8_t *lz_put_sequence(uint8_t *op, const uint8_t *literals, const size_t literal_len,
+                                const size_t offset, size_t match_len){
+    uint8_t *token = op++;
+    *token = (literal_len >= 15 ? 15 : literal_len) << 4;
+    if (literal_len >= 15) op = lz_put_length(op, literal_len - 15);
+    memcpy(op, literals, literal_len);
+    op += literal_len;
+
+    if (!match_len) return op; // Last sequence
+
+    *op++ = offset & 0xFF;
+    *op++ = offset >> 8;
+    match_len -= LZ_MIN_MATCH;
+    *token |= match_len >= 15 ? 15 : match_len;
+    if (match_len >= 15) op = lz_put_length(op, match_len - 15);
+    return op;
+}
+
+// Greedy single-pass compressor, returns compressed size or 0 if dst is smaller than lz_bound(len)
+size_t lz_compress(const uint8_t *src, const size_t len, uint8_t *dst, const size_t cap){
+    if (cap < lz_bound(len)) return 0;
+
+    uint32_t table[1 << LZ_HASH_BITS] = {0}; // Last position each 4 byte hash was seen at
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src; // Start of pending literals
+    const uint8_t *end = src + len;
+    const uint8_t *match_limit = len > LZ_MIN_MATCH ? end - LZ_MIN_MATCH : src;
+    uint8_t *op = dst;
+
+    while (ip < match_limit){
+        uint32_t seq, ref_seq;
+        memcpy(&seq, ip, 4);
+        const uint32_t hash = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        const uint8_t *ref = src + table[hash];
+        table[hash] = ip - src;
+
+        if (ref >= ip || ip - ref > LZ_MAX_OFFSET || (memcpy(&ref_seq, ref, 4), ref_seq != seq)){
+            // Step faster through data that doesn't compress
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        const size_t offset = ip - ref;
+        const uint8_t *match_end = ip + LZ_MIN_MATCH;
+        while (match_end < end && *match_end == match_end[-offset]) match_end++;
+
+        op = lz_put_sequence(op, anchor, ip - anchor, offset, match_end - ip);
+        ip = anchor = match_end;
+    }
+
+    op = lz_put_sequence(op, anchor, end - anchor, 0, 0);
+    return op - dst;
+}
+
+// Returns decompressed size, 0 if the input is corrupt or does not fit in cap bytes
+size_t lz_decompress(const uint8_t *src, const size_t len, uint8_t *dst, const size_t cap){
+    const uint8_t *ip = src;
+    const uint8_t *end = src + len;
+    uint8_t *op = dst;
+    uint8_t *op_end = dst + cap;
+
+    while (ip < end){
+        const uint8_t token = *ip++;
+
+        size_t n = token >> 4;
+        if (n == 15){
+            uint8_t b;
+            do{
+                if (ip >= end) return 0;
+                b = *ip++;
+                n += b;
+            } while (b == 255);
+        }
+        if ((size_t)(end - ip) < n || (size_t)(op_end - op) < n) return 0;
+        memcpy(op, ip, n);
+        op += n;
+        ip += n;
+
+        if (ip == end) break; // Last sequence has no match
+        if (end - ip < 2) return 0;
+        const size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+
+        n = token & 15;
+        if (n == 15){
+            uint8_t b;
+            do{
+                if (ip >= end) return 0;
+                b = *ip++;
+                n += b;
+            } while (b == 255);
+        }
+        n += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - dst) || (size_t)(op_end - op) < n) return 0;
+
+        const uint8_t *match = op - offset;
+        if (offset >= n){
+            memcpy(op, match, n);
+        }
+        else{
+            // Overlapping match repeats the last offset bytes
+            for (size_t i = 0; i < n; i++) op[i] = match[i];
+        }
+        op += n;
+    }
+    return op - dst;
+}
+
+// Machine state image used by save states, fixed layout in host byte order
+typedef struct{
+    uint64_t cycles;
+    uint32_t rng;
+    uint8_t ram[4096];
+    uint8_t display[64*32];
+    uint16_t stack[12];
+    uint8_t SP;
+    uint8_t V[16];
+    uint16_t I;
+    uint16_t PC;
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    uint8_t keypad[16];
+} chip8_state_t;
+
+_Static_assert(sizeof(bool) == 1, "display and keypad are copied as bytes");
+
+void save_chip8_state(const chip8_t *chip8, chip8_state_t *state){
+    memcpy(state->ram, chip8->ram, sizeof state->ram);
+    memcpy(state->display, chip8->display, sizeof state->display);
+    state->cycles = chip8->cycles;
+    state->rng = chip8->rng;
+    memcpy(state->stack, chip8->stack, sizeof state->stack);
+    state->SP = chip8->SP;
+    memcpy(state->V, chip8->V, sizeof state->V);
+    state->I = chip8->I;
+    state->PC = chip8->PC;
+    state->delay_timer = chip8->delay_timer;
+    state->sound_timer = chip8->sound_timer;
+    memcpy(state->keypad, chip8->keypad, sizeof state->keypad);
+}
+
+// Run state and ROM name are left as they are
+void load_chip8_state(chip8_t *chip8, const chip8_state_t *state){
+    memcpy(chip8->ram, state->ram, sizeof chip8->ram);
+    for (size_t i = 0; i < sizeof state->display; i++) chip8->display[i] = state->display[i] != 0;
+    chip8->cycles = state->cycles;
+    chip8->rng = state->rng;
+    memcpy(chip8->stack, state->stack, sizeof chip8->stack);
+    chip8->SP = state->SP < SDL_arraysize(chip8->stack) ? state->SP : 0;
+    memcpy(chip8->V, state->V, sizeof chip8->V);
+    chip8->I = state->I;
+    chip8->PC = state->PC;
+    chip8->delay_timer = state->delay_timer;
+    chip8->sound_timer = state->sound_timer;
+    for (size_t i = 0; i < sizeof state->keypad; i++) chip8->keypad[i] = state->keypad[i] != 0;
+}
+
+// Save state file: header followed by the LZ compressed chip8_state_t
+#define SAVE_STATE_MAGIC 0x56533843u // "C8SV"
+#define SAVE_STATE_VERSION 2
+
+typedef struct{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t state_size;      // sizeof(chip8_state_t) when written
+    uint32_t compressed_size;
+} save_state_header_t;
+
+void state_file_name(char *path, const size_t size, const chip8_t *chip8){
+    snprintf(path, size, "%s.state", chip8->rom_name ? chip8->rom_name : "chip8");
+}
+
+// Save states are taken from the emulation thread, their messages go through the async log.
+// Records only have room for a short text, so they name the file without its directory
+const char *state_file_log_name(const char *path){
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+bool save_state_file(const chip8_t *chip8){
+    chip8_state_t state;
+    uint8_t compressed[sizeof(chip8_state_t) + sizeof(chip8_state_t) / 255 + 16];
+    save_chip8_state(chip8, &state);
+
+    save_state_header_t header = {
+        .magic = SAVE_STATE_MAGIC,
+        .version = SAVE_STATE_VERSION,
+        .state_size = sizeof state,
+        .compressed_size = lz_compress((const uint8_t *)&state, sizeof state, compressed, sizeof compressed),
+    };
+
+    char path[4096];
+    state_file_name(path, sizeof path, chip8);
+    FILE *file = fopen(path, "wb");
+    bool ok = file &&
+              fwrite(&header, sizeof header, 1, file) == 1 &&
+              fwrite(compressed, header.compressed_size, 1, file) == 1;
+    if (file && fclose(file) != 0) ok = false;
+
+    if (!ok) log_event("Could not write save state %s\n", state_file_log_name(path), 0, 0, 0);
+    else log_event("Saved state to %s (%lld -> %lld bytes)\n", state_file_log_name(path), header.state_size,
+                   header.compressed_size, 0);
+    return ok;
+}
+
+bool load_state_file(chip8_t *chip8){
+    char path[4096];
+    state_file_name(path, sizeof path, chip8);
+    FILE *file = fopen(path, "rb");
+    if (!file){
+        log_event("No save state %s\n", state_file_log_name(path), 0, 0, 0);
+        return false;
+    }
+
+    save_state_header_t header;
+    chip8_state_t state;
+    uint8_t compressed[sizeof(chip8_state_t) + sizeof(chip8_state_t) / 255 + 16];
+    bool ok = fread(&header, sizeof header, 1, file) == 1 &&
+              header.magic == SAVE_STATE_MAGIC && header.version == SAVE_STATE_VERSION &&
+              header.state_size == sizeof state && header.compressed_size <= sizeof compressed &&
+              fread(compressed, header.compressed_size, 1, file) == 1 &&
+              lz_decompress(compressed, header.compressed_size, (uint8_t *)&state, sizeof state) == sizeof state;
+    fclose(file);
+
+    if (!ok){
+        log_event("Save state %s is invalid\n", state_file_log_name(path), 0, 0, 0);
+        return false;
+    }
+    load_chip8_state(chip8, &state);
+    log_event("Loaded state from %s\n", state_file_log_name(path), 0, 0, 0);
+    return true;
+}
+
+// Save slots and the last session live in a memory-mapped <rom>.slots file,
+// saving and resuming are plain copies between the mapping and chip8_t
+#define SLOT_FILE_MAGIC 0x4C533843u // "C8SL"
+#define SLOT_FILE_VERSION 2
+#define SLOT_COUNT 4
+
+typedef struct{
+    uint32_t valid; // Cleared while the state is being written
+    uint32_t reserved;
+    chip8_state_t state;
+} save_slot_t;
+
+typedef struct{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t state_size; // sizeof(chip8_state_t) when created
+    uint32_t reserved;
+    uint64_t rom_hash;   // Slots belong to this ROM, anything else starts a fresh file
+    save_slot_t session; // Where the player was when the emulator last exited
+    save_slot_t slots[SLOT_COUNT];
+} slot_file_t;
+
+typedef struct{
+    slot_file_t *file; // NULL until first used
+    uint32_t selected; // Slot used by the save/load hotkeys
+} slots_t;
+
+bool open_slots(slots_t *slots, const chip8_t *chip8){
+    if (slots->file) return true;
+
+    char path[4096];
+    snprintf(path, sizeof path, "%s.slots", chip8->rom_name ? chip8->rom_name : "chip8");
+    const int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || ftruncate(fd, sizeof(slot_file_t)) != 0){
+        SDL_Log("Could not open save slots %s\n", path);
+        if (fd >= 0) close(fd);
+        return false;
+    }
+
+    void *map = mmap(NULL, sizeof(slot_file_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED){
+        SDL_Log("Could not map save slots %s\n", path);
+        return false;
+    }
+
+    slot_file_t *file = map;
+    if (file->magic != SLOT_FILE_MAGIC || file->version != SLOT_FILE_VERSION ||
+        file->state_size != sizeof(chip8_state_t) || file->rom_hash != chip8->rom_hash){
+        memset(file, 0, sizeof *file);
+        file->magic = SLOT_FILE_MAGIC;
+        file->version = SLOT_FILE_VERSION;
+        file->state_size = sizeof(chip8_state_t);
+        file->rom_hash = chip8->rom_hash;
+    }
+    slots->file = file;
+    return true;
+}
+
+void close_slots(slots_t *slots){
+    if (slots->file) munmap(slots->file, sizeof *slots->file);
+    slots->file = NULL;
+}
+
+// Writes go straight into the mapping, the kernel flushes them to disk even if we crash later
+void save_slot(save_slot_t *slot, const chip8_t *chip8){
+    slot->valid = 0;
+    save_chip8_state(chip8, &slot->state);
+    slot->valid = 1;
+}
+
+bool load_slot(const save_slot_t *slot, chip8_t *chip8){
+    if (!slot->valid) return false;
+    load_chip8_state(chip8, &slot->state);
+    return true;
+}
+
+// CHIP8 Keypad  QWERTY 
+// 123C          1234
+// 456D          qwer
+// 789E          asdf
+// A0BF          zxcv
+// Returns the keypad index for a keyboard key, -1 if it isn't mapped
+int keypad_index(const SDL_Keycode key){
+    switch (key){
+        case SDLK_1: return 0x1;
+        case SDLK_2: return 0x2;
+        case SDLK_3: return 0x3;
+        case SDLK_4: return 0xC;
+        case SDLK_q: return 0x4;
+        case SDLK_w: return 0x5;
+        case SDLK_e: return 0x6;
+        case SDLK_r: return 0xD;
+        case SDLK_a: return 0x7;
+        case SDLK_s: return 0x8;
+        case SDLK_d: return 0x9;
+        case SDLK_f: return 0xE;
+        case SDLK_z: return 0xA;
+        case SDLK_x: return 0x0;
+        case SDLK_c: return 0xB;
+        case SDLK_v: return 0xF;
+        default: return -1;
+    }
+}
+
+// Keypad state kept by keypad_watch, bit N is key N. SDL calls event watches as events enter the
+// queue, so the keypad no longer waits for the frame loop to drain it
+static SDL_atomic_t keypad_state;
+
+// Set or clear one bit of a keypad mask shared with other threads
+void update_keypad_mask(SDL_atomic_t *mask, const int key, const bool down){
+    int old;
+    do{
+        old = SDL_AtomicGet(mask);
+    } while (!SDL_AtomicCAS(mask, old, down ? old | (1 << key) : old & ~(1 << key)));
+}
+
+// SDL event watch, registered with SDL_AddEventWatch once the event subsystem is up
+int keypad_watch(void *userdata, SDL_Event *event){
+    (void)userdata;
+    if (event->type != SDL_KEYDOWN && event->type != SDL_KEYUP) return 0;
+    const int key = keypad_index(event->key.keysym.sym);
+    if (key >= 0) update_keypad_mask(&keypad_state, key, event->type == SDL_KEYDOWN);
+    return 0;
+}
+
+// Queue a ROM for the background loader, a newer request replaces an older one.
+// A reload of the running ROM comes from the same place it did, a ROM pack or a file
+void request_rom(rom_loader_t *loader, char *rom_name, const bool reload){
+    if (!loader){
+        SDL_free(rom_name);
+        return;
+    }
+    SDL_free(loader->request);
+    loader->request = rom_name;
+    loader->request_reload = reload;
+}
+
+// A NULL loader disables ROM swaps, loads off stops F2/F8 from rewinding the machine for replays
+void handle_input(chip8_t *chip8, rom_loader_t *loader, slots_t *slots, const bool loads) {
+    SDL_Event event;
+
+    while(SDL_PollEvent(&event)){
+        switch (event.type)
+        {
+        case SDL_QUIT:
+            chip8->state = QUIT; // Quit main emulator loop
+            return;
+        case SDL_DROPFILE:
+            // Load the dropped ROM in the background
+            request_rom(loader, event.drop.file, false);
+            break;
+        case SDL_KEYDOWN:
+            switch(event.key.keysym.sym){
+                case SDLK_ESCAPE:
+                    chip8->state = QUIT;
+                    return;
+                case SDLK_SPACE:
+                    // Spacebar
+                    if (chip8->state == RUNNING){
+                        chip8->state = PAUSED;
+                        log_event("==== PAUSED ====\n", NULL, 0, 0, 0);
+                    }
+                    else{
+                       chip8->state = RUNNING; 
+                       log_event("==== RUNNING ====\n", NULL, 0, 0, 0);
+                    }
+                    break;
+                case SDLK_F1:
+                    // Save state to <rom>.state
+                    save_state_file(chip8);
+                    break;
+                case SDLK_F2:
+                    // Restore state from <rom>.state
+                    if (loads) load_state_file(chip8);
+                    else log_event("State loads are disabled for this run\n", NULL, 0, 0, 0);
+                    break;
+                case SDLK_F6:
+                    // Select next save slot
+                    if (slots){
+                        slots->selected = (slots->selected + 1) % SLOT_COUNT;
+                        log_event("Save slot %lld\n", NULL, slots->selected + 1, 0, 0);
+                    }
+                    break;
+                case SDLK_F7:
+                    // Save to the selected slot
+                    if (slots && open_slots(slots, chip8)){
+                        save_slot(&slots->file->slots[slots->selected], chip8);
+                        log_event("Saved slot %lld\n", NULL, slots->selected + 1, 0, 0);
+                    }
+                    break;
+                case SDLK_F8:
+                    // Load from the selected slot
+                    if (!loads) log_event("State loads are disabled for this run\n", NULL, 0, 0, 0);
+                    else if (slots && open_slots(slots, chip8)){
+                        if (load_slot(&slots->file->slots[slots->selected], chip8)) log_event("Loaded slot %lld\n", NULL, slots->selected + 1, 0, 0);
+                        else log_event("Save slot %lld is empty\n", NULL, slots->selected + 1, 0, 0);
+                    }
+                    break;
+                case SDLK_F5:
+                    // Reload the current ROM from disk or its ROM pack
+                    if (chip8->rom_name) request_rom(loader, SDL_strdup(chip8->rom_name), true);
+                    break;
+                default:
+                    break;
+            }
+            break;
+        default:
+            break;
+
+        }
+    }
+
+    // Keypad keys were already taken by keypad_watch
+    const int keys = SDL_AtomicGet(&keypad_state);
+    for (uint8_t i = 0; i < 16; i++) chip8->keypad[i] = (keys >> i) & 1;
+}
+
+// Update CHIP8 delay and sound timers every 60hz, the tone plays while sound_timer > 0
+void update_timers(sdl_t *sdl, const config_t *config, chip8_t *chip8){
+    if (chip8->delay_timer > 0) chip8->delay_timer--;
+
+    if (chip8->sound_timer > 0){
+        chip8->sound_timer--;
+        if (config->display == DISPLAY_SDL && init_audio(sdl, config, audio_callback, (void *)config)) SDL_PauseAudioDevice(sdl->dev, 0); // Play sound
+    }
+    else if (sdl->dev){
+        SDL_PauseAudioDevice(sdl->dev, 1); // Pause sound
+    }
+}
+
+// Built-in hex digit sprites, loaded at 0x000
+static const uint8_t font[] = {
+    0xF0, 0x90, 0x90, 0x90, 0xF0,   // 0   
+    0x20, 0x60, 0x20, 0x20, 0x70,   // 1  
+    0xF0, 0x10, 0xF0, 0x80, 0xF0,   // 2 
+    0xF0, 0x10, 0xF0, 0x10, 0xF0,   // 3
+    0x90, 0x90, 0xF0, 0x10, 0x10,   // 4    
+    0xF0, 0x80, 0xF0, 0x10, 0xF0,   // 5
+    0xF0, 0x80, 0xF0, 0x90, 0xF0,   // 6
+    0xF0, 0x10, 0x20, 0x40, 0x40,   // 7
+    0xF0, 0x90, 0xF0, 0x90, 0xF0,   // 8
+    0xF0, 0x90, 0xF0, 0x10, 0xF0,   // 9
+    0xF0, 0x90, 0xF0, 0x90, 0x90,   // A
+    0xE0, 0x90, 0xE0, 0x90, 0xE0,   // B
+    0xF0, 0x80, 0x80, 0x80, 0xF0,   // C
+    0xE0, 0x90, 0x90, 0x90, 0xE0,   // D
+    0xF0, 0x80, 0xF0, 0x80, 0xF0,   // E
+    0xF0, 0x80, 0xF0, 0x80, 0x80,   // F
+};
+
+bool init_chip8(chip8_t *chip8, const config_t config, const char rom_name[]){
+    const uint32_t entry_point = 0x200; // CHIP8 roms will be loaded to 0x200
+
+    // Load Font
+    memcpy(&chip8->ram[0], font, sizeof(font));
+
+    // Open ROM file
+    FILE *rom = fopen(rom_name, "rb");
+    if (!rom){
+        SDL_Log("ROM file invalid or does not exist\n");
+        return false;
+    }
+    fseek(rom, 0, SEEK_END);
+    const size_t rom_size = ftell(rom);
+    const size_t max_size = sizeof chip8->ram - entry_point;
+    rewind(rom); 
+
+    if (rom_size > max_size){
+        SDL_Log("ROM file is too big\n");
+        fclose(rom);
+        return false;
+    }
+
+    // Load ROM
+    // Read in ram from entry point the rom_size
+    if (fread(&chip8->ram[entry_point], rom_size, 1, rom) !=1){
+        SDL_Log("Could not read ROM file into CHIP8 memory\n");
+        fclose(rom);
+        return false;
+    }
+
+    fclose(rom);
+    chip8->rom_hash = hash64(&chip8->ram[entry_point], rom_size, 0);
+
+    // Set defauts
+    chip8->state = RUNNING;
+    chip8->PC = entry_point; //Start program counter at ROM entry point
+    chip8->rom_name = rom_name;
+    chip8->rng = config.seed ? config.seed : 1; // xorshift state must not be 0
+
+    return true;
+}
+
+// Same as init_chip8 but the ROM image is already in memory (e.g. mapped from a ROM pack)
+bool init_chip8_from_memory(chip8_t *chip8, const config_t config, const uint8_t rom[],
+                            const size_t rom_size, const char rom_name[]){
+    const uint32_t entry_point = 0x200; // CHIP8 roms will be loaded to 0x200
+
+    if (rom_size > sizeof chip8->ram - entry_point){
+        SDL_Log("ROM %s is too big\n", rom_name);
+        return false;
+    }
+
+    // Load Font and ROM
+    memcpy(&chip8->ram[0], font, sizeof(font));
+    memcpy(&chip8->ram[entry_point], rom, rom_size);
+    chip8->rom_hash = hash64(rom, rom_size, 0);
+
+    // Set defauts
+    chip8->state = RUNNING;
+    chip8->PC = entry_point; //Start program counter at ROM entry point
+    chip8->rom_name = rom_name;
+    chip8->rng = config.seed ? config.seed : 1; // xorshift state must not be 0
+
+    return true;
+}
+
+// Emulate 1 CHIP8 instruction
+void emulate_instruction(chip8_t *chip8, const config_t *config){
+    // Get next opcode from ram
+    const uint16_t opcode = (chip8->ram[chip8->PC & 0xFFF] << 8) | chip8->ram[(chip8->PC + 1) & 0xFFF];
+    chip8->PC += 2; // Pre-increment program counter for next opcode
+    chip8->cycles++;
+
+    // Fill out instruction format
+    const uint16_t NNN = opcode & 0x0FFF; // 12 bit address/constant
+    const uint8_t NN = opcode & 0x0FF;    // 8 bit constant
+    const uint8_t N = opcode & 0x0F;      // 4 bit constant
+    const uint8_t X = (opcode >> 8) & 0x0F; // 4 bit register identifier
+    const uint8_t Y = (opcode >> 4) & 0x0F; // 4 bit register identifier
+
+    // Emulate opcode
+    switch ((opcode >> 12) & 0x0F){
+        case 0x0:
+            if (NN == 0xE0){
+                // 0x00E0: Clear the screen
+                memset(&chip8->display[0], false, sizeof chip8->display);
+                chip8->draw = true;
+            }
+            else if (NN == 0xEE){
+                // 0x00EE: Return from subroutine, pop the last address from the stack
+                if (chip8->SP == 0){
+                    SDL_Log("Stack underflow at 0x%04X\n", chip8->PC - 2);
+                    chip8->state = QUIT;
+                    break;
+                }
+                chip8->PC = chip8->stack[--chip8->SP];
+            }
+            // 0x0NNN: Call machine code routine, unimplemented
+            break;
+
+        case 0x1:
+            // 0x1NNN: Jump to address NNN
+            chip8->PC = NNN;
+            break;
+
+        case 0x2:
+            // 0x2NNN: Call subroutine at NNN, push the return address on the stack
+            if (chip8->SP == SDL_arraysize(chip8->stack)){
+                SDL_Log("Stack overflow at 0x%04X\n", chip8->PC - 2);
+                chip8->state = QUIT;
+                break;
+            }
+            chip8->stack[chip8->SP++] = chip8->PC;
+            chip8->PC = NNN;
+            break;
+
+        case 0x3:
+            // 0x3XNN: Skip next instruction if VX == NN
+            if (chip8->V[X] == NN) chip8->PC += 2;
+            break;
+
+        case 0x4:
+            // 0x4XNN: Skip next instruction if VX != NN
+            if (chip8->V[X] != NN) chip8->PC += 2;
+            break;
+
+        case 0x5:
+            // 0x5XY0: Skip next instruction if VX == VY
+            if (N == 0 && chip8->V[X] == chip8->V[Y]) chip8->PC += 2;
+            break;
+
+        case 0x6:
+            // 0x6XNN: Set VX to NN
+            chip8->V[X] = NN;
+            break;
+
+        case 0x7:
+            // 0x7XNN: Add NN to VX, no carry
+            chip8->V[X] += NN;
+            break;
+
+        case 0x8: {
+            // VF is written last so it wins when X is F
+            uint8_t carry;
+            switch (N){
+                case 0x0:
+                    // 0x8XY0: Set VX = VY
+                    chip8->V[X] = chip8->V[Y];
+                    break;
+                case 0x1:
+                    // 0x8XY1: Set VX |= VY
+                    chip8->V[X] |= chip8->V[Y];
+                    if (config->quirks & QUIRK_VF_RESET) chip8->V[0xF] = 0;
+                    break;
+                case 0x2:
+                    // 0x8XY2: Set VX &= VY
+                    chip8->V[X] &= chip8->V[Y];
+                    if (config->quirks & QUIRK_VF_RESET) chip8->V[0xF] = 0;
+                    break;
+                case 0x3:
+                    // 0x8XY3: Set VX ^= VY
+                    chip8->V[X] ^= chip8->V[Y];
+                    if (config->quirks & QUIRK_VF_RESET) chip8->V[0xF] = 0;
+                    break;
+                case 0x4:
+                    // 0x8XY4: Set VX += VY, VF = 1 on carry
+                    carry = (uint16_t)(chip8->V[X] + chip8->V[Y]) > 255;
+                    chip8->V[X] += chip8->V[Y];
+                    chip8->V[0xF] = carry;
+                    break;
+                case 0x5:
+                    // 0x8XY5: Set VX -= VY, VF = 1 if there was no borrow
+                    carry = chip8->V[Y] <= chip8->V[X];
+                    chip8->V[X] -= chip8->V[Y];
+                    chip8->V[0xF] = carry;
+                    break;
+                case 0x6:
+                    // 0x8XY6: Set VX = VY >> 1 (or VX >>= 1), VF = shifted out bit
+                    if (!(config->quirks & QUIRK_SHIFTING)) chip8->V[X] = chip8->V[Y];
+                    carry = chip8->V[X] & 1;
+                    chip8->V[X] >>= 1;
+                    chip8->V[0xF] = carry;
+                    break;
+                case 0x7:
+                    // 0x8XY7: Set VX = VY - VX, VF = 1 if there was no borrow
+                    carry = chip8->V[X] <= chip8->V[Y];
+                    chip8->V[X] = chip8->V[Y] - chip8->V[X];
+                    chip8->V[0xF] = carry;
+                    break;
+                case 0xE:
+                    // 0x8XYE: Set VX = VY << 1 (or VX <<= 1), VF = shifted out bit
+                    if (!(config->quirks & QUIRK_SHIFTING)) chip8->V[X] = chip8->V[Y];
+                    carry = (chip8->V[X] & 0x80) >> 7;
+                    chip8->V[X] <<= 1;
+                    chip8->V[0xF] = carry;
+                    break;
+                default:
+                    // Wrong/unimplemented opcode
+                    break;
+            }
+            break;
+        }
+
+        case 0x9:
+            // 0x9XY0: Skip next instruction if VX != VY
+            if (N == 0 && chip8->V[X] != chip8->V[Y]) chip8->PC += 2;
+            break;
+
+        case 0xA:
+            // 0xANNN: Set index register I to NNN
+            chip8->I = NNN;
+            break;
+
+        case 0xB:
+            // 0xBNNN: Jump to V0 + NNN (or VX + XNN)
+            chip8->PC = NNN + chip8->V[config->quirks & QUIRK_JUMPING ? X : 0];
+            break;
+
+        case 0xC:
+            // 0xCXNN: Set VX = random byte & NN
+            chip8->rng ^= chip8->rng << 13;
+            chip8->rng ^= chip8->rng >> 17;
+            chip8->rng ^= chip8->rng << 5;
+            chip8->V[X] = (chip8->rng >> 24) & NN;
+            break;
+
+        case 0xD: {
+            // 0xDXYN: Draw N-height sprite at coords X,Y, read from memory location I.
+            //   Screen pixels are XOR'd with sprite bits, VF (Carry flag) is set if any
+            //   screen pixels are turned off.
+            const uint8_t orig_X = chip8->V[X] % config->window_width;
+            const uint8_t orig_Y = chip8->V[Y] % config->window_height;
+            chip8->V[0xF] = 0; // Initialize carry flag to 0
+
+            for (uint8_t i = 0; i < N; i++){
+                uint32_t Y_coord = orig_Y + i;
+                if (Y_coord >= config->window_height){
+                    if (config->quirks & QUIRK_CLIPPING) break;
+                    Y_coord %= config->window_height;
+                }
+
+                // Get next byte/row of sprite data
+                const uint8_t sprite_data = chip8->ram[(chip8->I + i) & 0xFFF];
+
+                for (int8_t j = 7; j >= 0; j--){
+                    uint32_t X_coord = orig_X + (7 - j);
+                    if (X_coord >= config->window_width){
+                        if (config->quirks & QUIRK_CLIPPING) break;
+                        X_coord %= config->window_width;
+                    }
+
+                    // If sprite pixel/bit is on and display pixel is on, set carry flag
+                    bool *pixel = &chip8->display[Y_coord * config->window_width + X_coord];
+                    const bool sprite_bit = (sprite_data & (1 << j));
+                    if (sprite_bit && *pixel) chip8->V[0xF] = 1;
+
+                    // XOR display pixel with sprite pixel/bit to set it on or off
+                    *pixel ^= sprite_bit;
+                }
+            }
+            chip8->draw = true;
+            break;
+        }
+
+        case 0xE:
+            if (NN == 0x9E){
+                // 0xEX9E: Skip next instruction if key in VX is pressed
+                if (chip8->keypad[chip8->V[X] & 0xF]) chip8->PC += 2;
+            }
+            else if (NN == 0xA1){
+                // 0xEXA1: Skip next instruction if key in VX is not pressed
+                if (!chip8->keypad[chip8->V[X] & 0xF]) chip8->PC += 2;
+            }
+            break;
+
+        case 0xF:
+            switch (NN){
+                case 0x07:
+                    // 0xFX07: VX = delay timer
+                    chip8->V[X] = chip8->delay_timer;
+                    break;
+
+                case 0x0A: {
+                    // 0xFX0A: Wait for a key press, store the lowest pressed key in VX
+                    bool any_key_pressed = false;
+                    for (uint8_t i = 0; i < sizeof chip8->keypad; i++){
+                        if (chip8->keypad[i]){
+                            chip8->V[X] = i;
+                            any_key_pressed = true;
+                            break;
+                        }
+                    }
+                    // Keep getting the current opcode until a key is pressed
+                    if (!any_key_pressed) chip8->PC -= 2;
+                    break;
+                }
+
+                case 0x15:
+                    // 0xFX15: Delay timer = VX
+                    chip8->delay_timer = chip8->V[X];
+                    break;
+
+                case 0x18:
+                    // 0xFX18: Sound timer = VX
+                    chip8->sound_timer = chip8->V[X];
+                    break;
+
+                case 0x1E:
+                    // 0xFX1E: I += VX
+                    chip8->I += chip8->V[X];
+                    break;
+
+                case 0x29:
+                    // 0xFX29: Set I to sprite location in memory for character in VX (0x0-0xF)
+                    chip8->I = (chip8->V[X] & 0xF) * 5;
+                    break;
+
+                case 0x33: {
+                    // 0xFX33: Store BCD representation of VX at memory offset from I
+                    uint8_t bcd = chip8->V[X];
+                    chip8->ram[(chip8->I + 2) & 0xFFF] = bcd % 10;
+                    bcd /= 10;
+                    chip8->ram[(chip8->I + 1) & 0xFFF] = bcd % 10;
+                    bcd /= 10;
+                    chip8->ram[chip8->I & 0xFFF] = bcd;
+                    break;
+                }
+
+                case 0x55:
+                    // 0xFX55: Register dump V0-VX inclusive to memory offset from I
+                    for (uint8_t i = 0; i <= X; i++) chip8->ram[(chip8->I + i) & 0xFFF] = chip8->V[i];
+                    if (config->quirks & QUIRK_MEMORY) chip8->I += X + 1;
+                    break;
+
+                case 0x65:
+                    // 0xFX65: Register load V0-VX inclusive from memory offset from I
+                    for (uint8_t i = 0; i <= X; i++) chip8->V[i] = chip8->ram[(chip8->I + i) & 0xFFF];
+                    if (config->quirks & QUIRK_MEMORY) chip8->I += X + 1;
+                    break;
+
+                default:
+                    break;
+            }
+            break;
+
+        default:
+            break; // Unimplemented or invalid opcode
+    }
+}
+
+// Handler table core. Each handler gets the whole opcode and decodes only the fields it needs.
+typedef void (*opcode_handler_t)(chip8_t *chip8, const config_t *config, const uint16_t opcode);
+
+static void op_system(chip8_t *chip8, const config_t *config, const uint16_t opcode){
+    (void)config;
+    if ((opcode & 0xFF) == 0xE0){
+        memset(chip8->display, false, sizeof chip8->display);
+        chip8->draw = true;
+    }
+    else if ((opcode & 0xFF) == 0xEE){
+        if (chip8->SP == 0){
+            SDL_Log("Stack underflow at 0x%04X\n", chip8->PC - 2);
+            chip8->state = QUIT;
+            return;
+        }
+        chip8->PC = chip8->stack[--chip8->SP];
+    }
+}
+
+static void op_jump(chip8_t *chip8, const config_t *config, const uint16_t opcode){
+    (void)config;
+    chip8->PC = opcode & 0x0FFF;
+}
+
+static void op_call(chip8_t *chip8, const config_t *config, const uint16_t opcode){
+    (void)config;
+    if (chip8->SP == SDL_arraysize(chip8->stack)){
+        SDL_Log("Stack overflow at 0x%04X\n", chip8->PC - 2);
+        chip8->state = QUIT;
+        return;
+    }
+    chip8->stack[chip8->SP++] = chip8->PC;
+    chip8->PC = opcode & 0x0FFF;
+}
+
+static void op_skip_eq_imm(chip8_t *chip8, const config_t *config, const uint16_t opcode){
+    (void)config;
+    chip8->PC += (chip8->V[(opcode >> 8) & 0xF] == (opcode & 0xFF)) << 1;
+}
+
+static void op_skip_ne_imm(chip8_t *chip8, const config_t *config, const uint16_t opcode){
+    (void)config;
+    chip8->PC += (chip8->V[(opcode >> 8) & 0xF] != (opcode & 0xFF)) << 1;
+}
+
+static void op_skip_eq_reg(chip8_t *chip8, const config_t *config, const uint16_t opcode){
+    (void)config;
+    if ((opcode & 0xF) == 0) chip8->PC += (chip8->V[(opcode >> 8) & 0xF] == chip8->V[(opcode >> 4) & 0xF]) << 1;
+}
+
+static void op_set_imm(chip8_t *chip8, const config_t *config, const uint16_t opcode){
+    (void)config;
+    chip8->V[(opcode >> 8) & 0xF] = opcode & 0xFF;
+}
+
+static void op_add_imm(chip8_t *chip8, const config_t *config, const uint16_t opcode){
+    (void)config;
+    chip8->V[(opcode >> 8) & 0xF] += opcode & 0xFF;
+}
+
+static void op_alu(chip8_t *chip8, const config_t *config, const uint16_t opcode){
+    const uint8_t X = (opcode >> 8) & 0xF;
+    const uint8_t Y = (opcode >> 4) & 0xF;
+    const uint8_t vx = chip8->V[X];
+    const uint8_t vy = chip8->V[Y];
+    const bool vf_reset = config->quirks & QUIRK_VF_RESET;
+    const uint8_t shift_in = config->quirks & QUIRK_SHIFTING ? vx : vy;
+
+    // VF is written last so it wins when X is F
+    switch (opcode & 0xF){
+        case 0x0: chip8->V[X] = vy; break;
+        case 0x1: chip8->V[X] = vx | vy; if (vf_reset) chip8->V[0xF] = 0; break;
+        case 0x2: chip8->V[X] = vx & vy; if (vf_reset) chip8->V[0xF] = 0; break;
+        case 0x3: chip8->V[X] = vx ^ vy; if (vf_reset) chip8->V[0xF] = 0; break;
+        case 0x4: chip8->V[X] = vx + vy; chip8->V[0xF] = vx + vy > 255; break;
+        case 0x5: chip8->V[X] = vx - vy; chip8->V[0xF] = vy <= vx; break;
+        case 0x6: chip8->V[X] = shift_in >> 1; chip8->V[0xF] = shift_in & 1; break;
+        case 0x7: chip8->V[X] = vy - vx; chip8->V[0xF] = vx <= vy; break;
+        case 0xE: chip8->V[X] = shift_in << 1; chip8->V[0xF] = shift_in >> 7; break;
+        default: break;
+    }
+}
+
+static void op_skip_ne_reg(chip8_t *chip8, const config_t *config, const uint16_t opcode){
+    (void)config;
+    if ((opcode & 0xF) == 0) chip8->PC += (chip8->V[(opcode >> 8) & 0xF] != chip8->V[(opcode >> 4) & 0xF]) << 1;
+}
+
+static void op_set_index(chip8_t *chip8, const config_t *config, const uint16_t opcode){
+    (void)config;
+    chip8->I = opcode & 0x0FFF;
+}
+
+static void op_jump_offset(chip8_t *chip8, const config_t *config, const uint16_t opcode){
+    chip8->PC = (opcode & 0x0FFF) + chip8->V[config->quirks & QUIRK_JUMPING ? (opcode >> 8) & 0xF : 0];
+}
+
+static void op_random(chip8_t *chip8, const config_t *config, const uint16_t opcode){
+    (void)config;
+    uint32_t rng = chip8->rng;
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    chip8->rng = rng;
+    chip8->V[(opcode >> 8) & 0xF] = (rng >> 24) & opcode & 0xFF;
+}
+
+static void op_draw(chip8_t *chip8, const config_t *config, const uint16_t opcode){
+    const uint32_t width = config->window_width;
+    const uint32_t height = config->window_height;
+    const uint32_t x = chip8->V[(opcode >> 8) & 0xF] % width;
+    const uint32_t y = chip8->V[(opcode >> 4) & 0xF] % height;
+    const uint32_t n = opcode & 0xF;
+    const bool clipping = config->quirks & QUIRK_CLIPPING;
+    uint8_t collision = 0;
+
+    // Rows and columns that land on screen without wrapping
+    const uint32_t rows = clipping && y + n > height ? height - y : n;
+    const uint32_t cols = x + 8 > width ? width - x : 8;
+
+    for (uint32_t row = 0; row < rows; row++){
+        const uint8_t sprite_data = chip8->ram[(chip8->I + row) & 0xFFF];
+        if (!sprite_data) continue;
+
+        bool *line = &chip8->display[((y + row) % height) * width];
+        for (uint32_t col = 0; col < cols; col++){
+            const bool bit = (sprite_data >> (7 - col)) & 1;
+            collision |= bit & line[x + col];
+            line[x + col] ^= bit;
+        }
+        // Columns past the right edge wrap around unless clipped
+        for (uint32_t col = cols; !clipping && col < 8; col++){
+            const bool bit = (sprite_data >> (7 - col)) & 1;
+            collision |= bit & line[(x + col) % width];
+            line[(x + col) % width] ^= bit;
+        }
+    }
+    chip8->V[0xF] = collision;
+    chip8->draw = true;
+}
+
+static void op_key(chip8_t *chip8, const config_t *config, const uint16_t opcode){
+    (void)config;
+    const bool pressed = chip8->keypad[chip8->V[(opcode >> 8) & 0xF] & 0xF];
+    if ((opcode & 0xFF) == 0x9E) chip8->PC += pressed << 1;
+    else if ((opcode & 0xFF) == 0xA1) chip8->PC += !pressed << 1;
+}
+
+static void op_misc(chip8_t *chip8, const config_t *config, const uint16_t opcode){
+    const uint8_t X = (opcode >> 8) & 0xF;
+
+    switch (opcode & 0xFF){
+        case 0x07: chip8->V[X] = chip8->delay_timer; break;
+        case 0x0A:
+            for (uint8_t i = 0; i < sizeof chip8->keypad; i++){
+                if (chip8->keypad[i]){
+                    chip8->V[X] = i;
+                    return;
+                }
+            }
+            chip8->PC -= 2;
+            break;
+        case 0x15: chip8->delay_timer = chip8->V[X]; break;
+        case 0x18: chip8->sound_timer = chip8->V[X]; break;
+        case 0x1E: chip8->I += chip8->V[X]; break;
+        case 0x29: chip8->I = (chip8->V[X] & 0xF) * 5; break;
+        case 0x33:
+            chip8->ram[chip8->I & 0xFFF] = chip8->V[X] / 100;
+            chip8->ram[(chip8->I + 1) & 0xFFF] = chip8->V[X] / 10 % 10;
+            chip8->ram[(chip8->I + 2) & 0xFFF] = chip8->V[X] % 10;
+            break;
+        case 0x55:
+            if (chip8->I + X < sizeof chip8->ram) memcpy(&chip8->ram[chip8->I], chip8->V, X + 1);
+            else for (uint8_t i = 0; i <= X; i++) chip8->ram[(chip8->I + i) & 0xFFF] = chip8->V[i];
+            if (config->quirks & QUIRK_MEMORY) chip8->I += X + 1;
+            break;
+        case 0x65:
+            if (chip8->I + X < sizeof chip8->ram) memcpy(chip8->V, &chip8->ram[chip8->I], X + 1);
+            else for (uint8_t i = 0; i <= X; i++) chip8->V[i] = chip8->ram[(chip8->I + i) & 0xFFF];
+            if (config->quirks & QUIRK_MEMORY) chip8->I += X + 1;
+            break;
+        default: break;
+    }
+}
+
+static const opcode_handler_t opcode_handlers[16] = {
+    op_system, op_jump, op_call, op_skip_eq_imm,
+    op_skip_ne_imm, op_skip_eq_reg, op_set_imm, op_add_imm,
+    op_alu, op_skip_ne_reg, op_set_index, op_jump_offset,
+    op_random, op_draw, op_key, op_misc,
+};
+
+// Same instruction set as emulate_instruction, dispatched through opcode_handlers
+void emulate_instruction_table(chip8_t *chip8, const config_t *config){
+    const uint16_t opcode = (chip8->ram[chip8->PC & 0xFFF] << 8) | chip8->ram[(chip8->PC + 1) & 0xFFF];
+    chip8->PC += 2;
+    chip8->cycles++;
+    opcode_handlers[opcode >> 12](chip8, config, opcode);
+}
+
+typedef void (*core_fn_t)(chip8_t *chip8, const config_t *config);
+
+static const core_fn_t core_functions[CORE_COUNT] = {
+    [CORE_REFERENCE] = emulate_instruction,
+    [CORE_TABLE]     = emulate_instruction_table,
+};
+
+// Replay file: header, then one record per keypad change.
+// A record is the cycle delta since the previous record as an unsigned LEB128 varint,
+// followed by the new 16 bit keypad mask (bit n = key n) in little endian.
+#define REPLAY_MAGIC 0x50523843u // "C8RP"
+#define REPLAY_VERSION 1
+
+typedef struct{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t rom_hash;     // Replays only play back on the ROM they were recorded on
+    uint64_t total_cycles; // Cycle count when recording stopped, playback ends here
+    uint32_t platform;
+    uint32_t quirks;
+    uint32_t insts_per_second;
+    uint32_t seed;         // CXNN seed the recording started with
+} replay_header_t;
+
+typedef struct{
+    replay_header_t header;
+
+    // Recording
+    FILE *out;
+    uint64_t last_cycle; // Cycle of the last written record
+    uint16_t last_mask;
+    bool write_failed;   // A record couldn't be written, the file is cut short there
+
+    // Playback, records are decoded one at a time straight out of the mapping
+    const uint8_t *data;
+    size_t size;
+    size_t pos;
+    uint64_t next_cycle; // Cycle the next record applies at
+    uint16_t next_mask;
+    bool has_next;
+} replay_t;
+
+uint16_t keypad_mask(const chip8_t *chip8){
+    uint16_t mask = 0;
+    for (uint8_t i = 0; i < 16; i++){
+        if (chip8->keypad[i]) mask |= 1 << i;
+    }
+    return mask;
+}
+
+bool start_recording(replay_t *replay, const char *path, const chip8_t *chip8, const config_t config){
+    replay->out = fopen(path, "wb");
+    if (!replay->out){
+        SDL_Log("Could not create replay %s\n", path);
+        return false;
+    }
+
+    replay->header = (replay_header_t){
+        .magic = REPLAY_MAGIC,
+        .version = REPLAY_VERSION,
+        .rom_hash = chip8->rom_hash,
+        .platform = config.platform,
+        .quirks = config.quirks,
+        .insts_per_second = config.insts_per_second,
+        .seed = chip8->rng,
+    };
+    replay->last_cycle = chip8->cycles;
+    replay->last_mask = keypad_mask(chip8);
+
+    // Header is rewritten with the final cycle count when recording stops
+    if (fwrite(&replay->header, sizeof replay->header, 1, replay->out) != 1){
+        SDL_Log("Could not write replay %s\n", path);
+        fclose(replay->out);
+        replay->out = NULL;
+        return false;
+    }
+    return true;
+}
+
+// Append a record if the keypad changed since the last one
+void record_input(replay_t *replay, const chip8_t *chip8){
+    const uint16_t mask = keypad_mask(chip8);
+    if (mask == replay->last_mask) return;
+
+    uint8_t record[10 + 2];
+    size_t len = 0;
+    uint64_t delta = chip8->cycles - replay->last_cycle;
+    do{
+        record[len++] = (delta & 0x7F) | (delta > 0x7F ? 0x80 : 0);
+        delta >>= 7;
+    } while (delta);
+    record[len++] = mask & 0xFF;
+    record[len++] = mask >> 8;
+    if (replay->write_failed) return;
+    if (fwrite(record, 1, len, replay->out) != len){
+        log_event("Could not write replay record, the replay ends at cycle %lld\n", NULL, replay->last_cycle, 0, 0);
+        replay->write_failed = true;
+        return;
+    }
+
+    replay->last_cycle = chip8->cycles;
+    replay->last_mask = mask;
+}
+
+bool stop_recording(replay_t *replay, const chip8_t *chip8){
+    // After a failed write the replay can only be trusted up to the last good record
+    replay->header.total_cycles = replay->write_failed ? replay->last_cycle : chip8->cycles;
+    bool ok = !replay->write_failed && fseek(replay->out, 0, SEEK_SET) == 0 &&
+              fwrite(&replay->header, sizeof replay->header, 1, replay->out) == 1;
+    if (fclose(replay->out) != 0) ok = false;
+    replay->out = NULL;
+    if (!ok) SDL_Log("Could not finish replay file\n");
+    return ok;
+}
+
+// Decode the next record, has_next is false at the end of the file or on a truncated record
+void replay_advance(replay_t *replay){
+    uint64_t delta = 0;
+    replay->has_next = false;
+
+    for (unsigned shift = 0; replay->pos < replay->size && shift < 64; shift += 7){
+        const uint8_t byte = replay->data[replay->pos++];
+        delta |= (uint64_t)(byte & 0x7F) << shift;
+        if (byte & 0x80) continue;
+
+        if (replay->size - replay->pos < 2) return;
+        replay->next_mask = replay->data[replay->pos] | replay->data[replay->pos + 1] << 8;
+        replay->pos += 2;
+        replay->next_cycle += delta;
+        replay->has_next = true;
+        return;
+    }
+}
+
+// Map a replay file and apply its settings to config, nothing past the header is read yet
+bool open_replay(replay_t *replay, const char *path, config_t *config){
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0){
+        SDL_Log("Could not open replay %s\n", path);
+        return false;
+    }
+
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(replay_header_t)){
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED){
+        SDL_Log("Could not map replay %s\n", path);
+        return false;
+    }
+
+    memcpy(&replay->header, data, sizeof replay->header);
+    if (replay->header.magic != REPLAY_MAGIC || replay->header.version != REPLAY_VERSION ||
+        replay->header.platform >= SDL_arraysize(platform_defaults)){
+        SDL_Log("Replay %s is invalid\n", path);
+        munmap(data, st.st_size);
+        return false;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    replay->data = data;
+    replay->size = st.st_size;
+    replay->pos = sizeof replay->header;
+    replay->next_cycle = 0;
+
+    // A recording that never reached stop_recording still has total_cycles 0, play it up to its last input
+    if (replay->header.total_cycles == 0){
+        for (replay_advance(replay); replay->has_next; replay_advance(replay)){
+            replay->header.total_cycles = replay->next_cycle;
+        }
+        if (replay->header.total_cycles) SDL_Log("Replay %s was not finished, playing up to its last input\n", path);
+        replay->pos = sizeof replay->header;
+        replay->next_cycle = 0;
+    }
+    replay_advance(replay);
+
+    config->platform = replay->header.platform;
+    config->quirks = replay->header.quirks;
+    config->insts_per_second = replay->header.insts_per_second;
+    config->seed = replay->header.seed;
+    return true;
+}
+
+void close_replay(replay_t *replay){
+    if (replay->data) munmap((void *)replay->data, replay->size);
+    replay->data = NULL;
+}
+
+// Apply every record that is due at the current cycle
+void apply_replay(replay_t *replay, chip8_t *chip8){
+    while (replay->has_next && replay->next_cycle <= chip8->cycles){
+        for (uint8_t i = 0; i < 16; i++) chip8->keypad[i] = (replay->next_mask >> i) & 1;
+        replay_advance(replay);
+    }
+}
+
+// Hash of everything that makes up the machine state: registers, timers, keypad, ram and display
+uint64_t hash_chip8(const chip8_t *chip8){
+    // Registers are packed into bytes so struct padding can't change the hash
+    uint8_t regs[8 + 4 + sizeof chip8->stack + 2 + 2 + 1 + sizeof chip8->V + 2 + sizeof chip8->keypad];
+    uint8_t *p = regs;
+    memcpy(p, &chip8->cycles, 8); p += 8;
+    memcpy(p, &chip8->rng, 4); p += 4;
+    memcpy(p, chip8->stack, sizeof chip8->stack); p += sizeof chip8->stack;
+    memcpy(p, &chip8->I, 2); p += 2;
+    memcpy(p, &chip8->PC, 2); p += 2;
+    *p++ = chip8->SP;
+    memcpy(p, chip8->V, sizeof chip8->V); p += sizeof chip8->V;
+    *p++ = chip8->delay_timer;
+    *p++ = chip8->sound_timer;
+    memcpy(p, chip8->keypad, sizeof chip8->keypad);
+
+    uint64_t hash = hash64(regs, sizeof regs, 0);
+    hash = hash64(chip8->ram, sizeof chip8->ram, hash);
+    return hash64(chip8->display, sizeof chip8->display, hash);
+}
+
+// State hash stream: header, then a (cycles, hash) record per frame or per instruction
+#define HASH_STREAM_MAGIC 0x53483843u // "C8HS"
+#define HASH_STREAM_VERSION 1
+
+typedef struct{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t rom_hash;
+    uint32_t per_instruction; // 1 if a record follows every instruction, 0 for every frame
+    uint32_t reserved;
+} hash_stream_header_t;
+
+typedef struct{
+    uint64_t cycles;
+    uint64_t hash;
+} hash_record_t;
+
+typedef struct{
+    hash_stream_header_t header;
+    FILE *out;                      // Writing a stream
+    const hash_record_t *reference; // Verifying against a mapped reference stream
+    size_t count;                   // Records in the reference
+    void *map;
+    size_t map_size;
+    size_t index;                   // Records written or checked so far
+    uint64_t frame;                 // Frames run so far
+    bool diverged;
+} hash_stream_t;
+
+bool open_hash_stream(hash_stream_t *stream, const char *path, const chip8_t *chip8, const config_t config){
+    stream->out = fopen(path, "wb");
+    stream->header = (hash_stream_header_t){
+        .magic = HASH_STREAM_MAGIC,
+        .version = HASH_STREAM_VERSION,
+        .rom_hash = chip8->rom_hash,
+        .per_instruction = config.hash_instructions,
+    };
+    if (!stream->out || fwrite(&stream->header, sizeof stream->header, 1, stream->out) != 1){
+        SDL_Log("Could not write hash stream %s\n", path);
+        if (stream->out) fclose(stream->out);
+        stream->out = NULL;
+        return false;
+    }
+    return true;
+}
+
+// Map a reference stream, its granularity (frame or instruction) is used for the run
+bool open_reference_stream(hash_stream_t *stream, const char *path, const chip8_t *chip8){
+    const int fd = open(path, O_RDONLY);
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(hash_stream_header_t)){
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    if (fd >= 0) close(fd);
+    if (map == MAP_FAILED){
+        SDL_Log("Could not map reference hash stream %s\n", path);
+        return false;
+    }
+
+    memcpy(&stream->header, map, sizeof stream->header);
+    if (stream->header.magic != HASH_STREAM_MAGIC || stream->header.version != HASH_STREAM_VERSION){
+        SDL_Log("Reference hash stream %s is invalid\n", path);
+        munmap(map, st.st_size);
+        return false;
+    }
+    if (stream->header.rom_hash != chip8->rom_hash){
+        SDL_Log("Reference hash stream %s was made with a different ROM\n", path);
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    stream->map = map;
+    stream->map_size = st.st_size;
+    stream->reference = (const hash_record_t *)((const uint8_t *)map + sizeof stream->header);
+    stream->count = (st.st_size - sizeof stream->header) / sizeof(hash_record_t);
+    return true;
+}
+
+// Write or check one record, on the first mismatch report where it happened and stop the machine
+void hash_stream_step(hash_stream_t *stream, chip8_t *chip8){
+    const hash_record_t record = {.cycles = chip8->cycles, .hash = hash_chip8(chip8)};
+
+    if (stream->out){
+        fwrite(&record, sizeof record, 1, stream->out);
+        stream->index++;
+        return;
+    }
+
+    if (stream->index >= stream->count){
+        SDL_Log("Diverged at frame %llu: reference stream ended at cycle %llu, run continues\n",
+                (unsigned long long)stream->frame, (unsigned long long)chip8->cycles);
+    }
+    else{
+        const hash_record_t *expected = &stream->reference[stream->index];
+        stream->index++;
+        if (expected->cycles == record.cycles && expected->hash == record.hash) return;
+
+        SDL_Log("Diverged at frame %llu, cycle %llu (reference cycle %llu): PC 0x%04X, I 0x%04X, "
+                "hash %016llx, reference %016llx\n",
+                (unsigned long long)stream->frame, (unsigned long long)record.cycles,
+                (unsigned long long)expected->cycles, chip8->PC, chip8->I,
+                (unsigned long long)record.hash, (unsigned long long)expected->hash);
+        if (!stream->header.per_instruction){
+            SDL_Log("Rerun the reference with --hash-instructions to find the instruction\n");
+        }
+    }
+    stream->diverged = true;
+    chip8->state = QUIT;
+}
+
+// Finish the stream, a verify run that stopped before the reference did has diverged too
+bool close_hash_stream(hash_stream_t *stream){
+    bool ok = !stream->diverged;
+    if (stream->out && fclose(stream->out) != 0){
+        SDL_Log("Could not write hash stream\n");
+        ok = false;
+    }
+    if (stream->map){
+        if (ok && stream->index != stream->count){
+            SDL_Log("Diverged: run stopped after %zu of %zu reference records\n", stream->index, stream->count);
+            ok = false;
+        }
+        else if (ok){
+            SDL_Log("Hash stream matches the reference (%zu records)\n", stream->count);
+        }
+        munmap(stream->map, stream->map_size);
+    }
+    memset(stream, 0, sizeof *stream);
+    return ok;
+}
+
+// Run one 60hz frame worth of instructions, with replay input applied at the exact recorded cycles
+// Run instructions up to cycle end without looking at anything else. Stops early on QUIT,
+// or once something was drawn if the platform waits for vblank after drawing.
+void run_instructions(chip8_t *chip8, const config_t config, const uint64_t end, hash_stream_t *stream){
+    const core_fn_t core = core_functions[config.core];
+    const bool display_wait = config.quirks & QUIRK_DISPLAY_WAIT;
+    const bool hash_each = stream && stream->header.per_instruction;
+
+    while (chip8->cycles < end && chip8->state == RUNNING && !(display_wait && chip8->draw)){
+        // A plain store, the profiler thread only needs some recent value
+        __atomic_store_n(&chip8->profile_pc, PROFILE_BUSY | chip8->PC, __ATOMIC_RELAXED);
+        core(chip8, &config);
+        if (hash_each) hash_stream_step(stream, chip8);
+    }
+    __atomic_store_n(&chip8->profile_pc, 0, __ATOMIC_RELAXED);
+}
+
+// One frame worth of instructions, split into batches at replay input changes
+void emulate_frame(chip8_t *chip8, const config_t config, replay_t *replay, hash_stream_t *stream){
+    const uint64_t frame_end = chip8->cycles + config.insts_per_second / 60;
+    chip8->draw = false;
+
+    while (chip8->cycles < frame_end && chip8->state == RUNNING &&
+           !(chip8->draw && (config.quirks & QUIRK_DISPLAY_WAIT))){
+        uint64_t end = frame_end;
+        if (replay && replay->data){
+            if (chip8->cycles >= replay->header.total_cycles){
+                chip8->state = QUIT; // End of replay
+                break;
+            }
+            apply_replay(replay, chip8);
+            if (replay->has_next && replay->next_cycle < end) end = replay->next_cycle;
+            if (replay->header.total_cycles < end) end = replay->header.total_cycles;
+        }
+        run_instructions(chip8, config, end, stream);
+    }
+
+    if (stream){
+        if (!stream->header.per_instruction && chip8->state != QUIT) hash_stream_step(stream, chip8);
+        stream->frame++;
+    }
+}
+
+// Scheduler for the main loop. Everything that isn't an instruction is an event keyed by the emulated
+// cycle it's due on, so the core runs uninterrupted batches from one event to the next and headless,
+// real-time and replay runs all take the same path. Events live in a hashed timer wheel.
+typedef enum{
+    EVENT_FRAME,        // vblank: frame hash, present, pacing, 60 Hz timers and sound, input
+    EVENT_AUTOSAVE,     // Copy the session into its slot once per emulated second
+    EVENT_REPLAY_END,
+    EVENT_REPLAY_INPUT, // Next keypad change from the replay
+    EVENT_COUNT,
+} event_type_t; // Events due on the same cycle run in this order
+
+#define WHEEL_SLOTS 64
+#define WHEEL_SHIFT 5 // 32 cycles per slot, 2048 per turn of the wheel
+
+typedef struct{
+    uint64_t due[EVENT_COUNT];  // There is at most one pending event of each type
+    uint8_t slots[WHEEL_SLOTS]; // Bit per event type due in the slot on some turn of the wheel
+    uint8_t pending;
+} scheduler_t;
+
+void cancel_event(scheduler_t *sched, const event_type_t type){
+    if (!(sched->pending & (1 << type))) return;
+    sched->slots[(sched->due[type] >> WHEEL_SHIFT) % WHEEL_SLOTS] &= ~(1 << type);
+    sched->pending &= ~(1 << type);
+}
+
+void schedule_event(scheduler_t *sched, const event_type_t type, const uint64_t cycle){
+    cancel_event(sched, type);
+    sched->due[type] = cycle;
+    sched->slots[(cycle >> WHEEL_SHIFT) % WHEEL_SLOTS] |= 1 << type;
+    sched->pending |= 1 << type;
+}
+
+// Cycle the next event is due on. Walks one turn of the wheel, events further out than that are
+// rare (autosave, end of a replay) and found by looking at every pending event.
+uint64_t next_event_cycle(const scheduler_t *sched, const uint64_t now){
+    for (uint64_t turn_slot = now >> WHEEL_SHIFT; turn_slot < (now >> WHEEL_SHIFT) + WHEEL_SLOTS; turn_slot++){
+        const uint8_t events = sched->slots[turn_slot % WHEEL_SLOTS];
+        uint64_t next = UINT64_MAX;
+        for (event_type_t type = 0; events && type < EVENT_COUNT; type++){
+            if ((events & (1 << type)) && sched->due[type] >> WHEEL_SHIFT == turn_slot && sched->due[type] < next){
+                next = sched->due[type];
+            }
+        }
+        if (next != UINT64_MAX) return next;
+    }
+
+    uint64_t next = UINT64_MAX;
+    for (event_type_t type = 0; type < EVENT_COUNT; type++){
+        if ((sched->pending & (1 << type)) && sched->due[type] < next) next = sched->due[type];
+    }
+    return next;
+}
+
+// Take the earliest event due by now off the wheel, EVENT_COUNT if there is none. Frame mode runs
+// whole frames past event cycles, so overdue events are looked for among all pending ones, not only
+// in the slot for now
+event_type_t pop_due_event(scheduler_t *sched, const uint64_t now){
+    event_type_t due = EVENT_COUNT;
+    for (event_type_t type = 0; sched->pending && type < EVENT_COUNT; type++){
+        if ((sched->pending & (1 << type)) && sched->due[type] <= now &&
+            (due == EVENT_COUNT || sched->due[type] < sched->due[due])) due = type;
+    }
+    if (due != EVENT_COUNT) cancel_event(sched, due);
+    return due;
+}
+
+// Start every event over from the machine's current cycle: at startup and whenever the cycle count
+// jumps (ROM swaps, state and slot loads). frame_mode runs whole frames from the frame event instead
+// of batches, for netplay and lockstep which work a frame at a time.
+void reset_schedule(scheduler_t *sched, const chip8_t *chip8, const config_t *config, const replay_t *replay,
+                    const bool frame_mode, const bool autosave){
+    const uint64_t now = chip8->cycles;
+    memset(sched, 0, sizeof *sched);
+
+    schedule_event(sched, EVENT_FRAME, frame_mode ? now : now + config->insts_per_second / 60);
+    if (autosave) schedule_event(sched, EVENT_AUTOSAVE, now + config->insts_per_second);
+    if (replay->data && !frame_mode){
+        schedule_event(sched, EVENT_REPLAY_END, replay->header.total_cycles > now ? replay->header.total_cycles : now);
+        if (replay->has_next){
+            schedule_event(sched, EVENT_REPLAY_INPUT, replay->next_cycle > now ? replay->next_cycle : now);
+        }
+    }
+}
+
+// Compare two machines field by field. Returns true if they match. With log set every difference is
+// logged, without it the compare stops at the first one, which is what lockstep runs per instruction
+bool compare_chip8(const chip8_t *a, const chip8_t *b, const bool log){
+    bool same = true;
+
+    for (uint8_t i = 0; i < 16; i++){
+        if (a->V[i] != b->V[i]){
+            if (!log) return false;
+            SDL_Log("  V%X: %02X vs %02X\n", i, a->V[i], b->V[i]);
+            same = false;
+        }
+    }
+    if (a->PC != b->PC){ if (!log) return false; SDL_Log("  PC: %04X vs %04X\n", a->PC, b->PC); same = false; }
+    if (a->I != b->I){ if (!log) return false; SDL_Log("  I: %04X vs %04X\n", a->I, b->I); same = false; }
+    if (a->SP != b->SP){ if (!log) return false; SDL_Log("  SP: %u vs %u\n", a->SP, b->SP); same = false; }
+    if (a->delay_timer != b->delay_timer){ if (!log) return false; SDL_Log("  delay timer: %u vs %u\n", a->delay_timer, b->delay_timer); same = false; }
+    if (a->sound_timer != b->sound_timer){ if (!log) return false; SDL_Log("  sound timer: %u vs %u\n", a->sound_timer, b->sound_timer); same = false; }
+    if (a->rng != b->rng){ if (!log) return false; SDL_Log("  rng: %08X vs %08X\n", a->rng, b->rng); same = false; }
+    if (a->cycles != b->cycles){ if (!log) return false; SDL_Log("  cycles: %llu vs %llu\n", (unsigned long long)a->cycles, (unsigned long long)b->cycles); same = false; }
+    if (a->state != b->state){ if (!log) return false; SDL_Log("  state: %d vs %d\n", a->state, b->state); same = false; }
+    if (a->draw != b->draw){ if (!log) return false; SDL_Log("  draw flag: %d vs %d\n", a->draw, b->draw); same = false; }
+    if (memcmp(a->keypad, b->keypad, sizeof a->keypad) != 0){
+        if (!log) return false;
+        SDL_Log("  keypad: %04X vs %04X\n", keypad_mask(a), keypad_mask(b));
+        same = false;
+    }
+    if (memcmp(a->stack, b->stack, sizeof a->stack) != 0){ if (!log) return false; SDL_Log("  stack differs\n"); same = false; }
+
+    if (memcmp(a->ram, b->ram, sizeof a->ram) != 0){
+        if (!log) return false;
+        for (size_t i = 0; i < sizeof a->ram; i++){
+            if (a->ram[i] != b->ram[i]) SDL_Log("  ram[%03zX]: %02X vs %02X\n", i, a->ram[i], b->ram[i]);
+        }
+        same = false;
+    }
+
+    if (memcmp(a->display, b->display, sizeof a->display) != 0){
+        if (!log) return false;
+        uint32_t pixels = 0;
+        for (size_t i = 0; i < sizeof a->display; i++) pixels += a->display[i] != b->display[i];
+        SDL_Log("  display: %u pixels differ\n", pixels);
+        same = false;
+    }
+    return same;
+}
+
+// Run one frame on two cores in lockstep, a runs config.core and b config.lockstep_core.
+// Stops both machines at the first instruction after which their states differ and returns false.
+bool emulate_frame_lockstep(chip8_t *a, chip8_t *b, const config_t config, replay_t *replay, hash_stream_t *stream){
+    const uint64_t frame_end = a->cycles + config.insts_per_second / 60;
+    a->draw = b->draw = false;
+
+    while (a->cycles < frame_end && a->state == RUNNING){
+        if (replay && replay->data){
+            if (a->cycles >= replay->header.total_cycles){
+                a->state = QUIT; // End of replay
+                break;
+            }
+            apply_replay(replay, a);
+            memcpy(b->keypad, a->keypad, sizeof b->keypad);
+        }
+
+        const uint16_t PC = a->PC;
+        __atomic_store_n(&a->profile_pc, PROFILE_BUSY | PC, __ATOMIC_RELAXED);
+        const uint16_t opcode = (a->ram[PC & 0xFFF] << 8) | a->ram[(PC + 1) & 0xFFF];
+        core_functions[config.core](a, &config);
+        core_functions[config.lockstep_core](b, &config);
+
+        if (!compare_chip8(a, b, false)){
+            SDL_Log("Cores %s and %s diverged at cycle %llu, opcode %04X at PC %04X:\n",
+                    core_names[config.core], core_names[config.lockstep_core], (unsigned long long)a->cycles,
+                    opcode, PC);
+            compare_chip8(a, b, true);
+            a->state = b->state = QUIT;
+            __atomic_store_n(&a->profile_pc, 0, __ATOMIC_RELAXED);
+            return false;
+        }
+        if (stream && stream->header.per_instruction) hash_stream_step(stream, a);
+
+        if (a->draw && (config.quirks & QUIRK_DISPLAY_WAIT)) break;
+    }
+    __atomic_store_n(&a->profile_pc, 0, __ATOMIC_RELAXED);
+    if (stream){
+        if (!stream->header.per_instruction && a->state != QUIT) hash_stream_step(stream, a);
+        stream->frame++;
+    }
+    return true;
+}
+
+// Rollback netplay: both peers run the same machine from the same seed and exchange keypad masks per
+// frame. The remote player's input is predicted to stay unchanged; when a confirmed input differs from
+// the prediction, the machine is restored to the snapshot before that frame and re-simulated to now.
+#define NETPLAY_MAGIC 0x504E3843 // "C8NP" little endian
+#define NETPLAY_VERSION 1
+#define NETPLAY_MAX_AHEAD 8 // Frames we may run past the last confirmed remote input before stalling
+#define NETPLAY_RING 32     // Per-frame history, covers NETPLAY_MAX_AHEAD frames either side of now
+
+// Sent by the host right after connecting, the joining peer adopts these settings
+typedef struct{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t rom_hash;
+    uint32_t seed;
+    uint32_t platform;
+    uint32_t quirks;
+    uint32_t insts_per_second;
+} netplay_hello_t;
+
+typedef struct{
+    uint32_t frame;
+    uint16_t keypad;   // Bit per key that player holds during the frame
+    uint16_t reserved;
+} netplay_input_t;
+
+typedef struct{
+    int fd;                  // SOCK_SEQPACKET, so every recv is one whole message. -1 when not playing
+    bool keypad[16];         // Local player's keys, kept apart from the machine's combined keypad
+    uint32_t frame;          // Next frame to simulate
+    uint32_t remote_frame;   // Remote input is confirmed for every frame before this
+    uint16_t last_remote;    // Latest confirmed remote input, the prediction for later frames
+    uint16_t local[NETPLAY_RING];
+    uint16_t remote[NETPLAY_RING];
+    uint16_t used[NETPLAY_RING];  // Remote input each frame was simulated with
+    chip8_state_t snapshots[NETPLAY_RING]; // Machine state at the start of each frame
+
+    uint64_t rollbacks;
+    uint64_t resimulated;    // Frames run again by rollbacks
+    uint32_t max_depth;
+    uint64_t rollback_ticks;
+    uint64_t max_rollback_ticks;
+    uint64_t stalls;         // Frames spent waiting for the remote peer
+} netplay_t;
+
+// Connect the two peers and agree on settings, blocks until the other side shows up.
+// The joining peer takes the host's seed, platform, quirks and speed, like a replay does.
+bool open_netplay(netplay_t *net, config_t *config, chip8_t *chip8){
+    memset(net, 0, sizeof *net);
+    net->fd = -1;
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(config->netplay_path) >= sizeof addr.sun_path){
+        SDL_Log("Netplay socket path %s is too long\n", config->netplay_path);
+        return false;
+    }
+    strcpy(addr.sun_path, config->netplay_path);
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0){
+        SDL_Log("Could not create netplay socket: %s\n", strerror(errno));
+        return false;
+    }
+
+    if (config->netplay_host){
+        unlink(config->netplay_path);
+        if (bind(fd, (struct sockaddr *)&addr, sizeof addr) != 0 || listen(fd, 1) != 0){
+            SDL_Log("Could not listen on %s: %s\n", config->netplay_path, strerror(errno));
+            close(fd);
+            return false;
+        }
+        SDL_Log("Waiting for the other player on %s\n", config->netplay_path);
+        const int listener = fd;
+        fd = accept(listener, NULL, NULL);
+        close(listener);
+        unlink(config->netplay_path);
+        if (fd < 0){
+            SDL_Log("Could not accept netplay connection: %s\n", strerror(errno));
+            return false;
+        }
+
+        const netplay_hello_t hello = {
+            .magic = NETPLAY_MAGIC,
+            .version = NETPLAY_VERSION,
+            .rom_hash = chip8->rom_hash,
+            .seed = chip8->rng,
+            .platform = config->platform,
+            .quirks = config->quirks,
+            .insts_per_second = config->insts_per_second,
+        };
+        if (send(fd, &hello, sizeof hello, MSG_NOSIGNAL) != sizeof hello){
+            SDL_Log("Could not send netplay settings: %s\n", strerror(errno));
+            close(fd);
+            return false;
+        }
+    }
+    else{
+        // The host may still be starting up, give it a few seconds
+        int tries = 50;
+        while (connect(fd, (struct sockaddr *)&addr, sizeof addr) != 0){
+            if (--tries == 0 || (errno != ENOENT && errno != ECONNREFUSED)){
+                SDL_Log("Could not connect to %s: %s\n", config->netplay_path, strerror(errno));
+                close(fd);
+                return false;
+            }
+            SDL_Delay(100);
+        }
+
+        netplay_hello_t hello;
+        if (recv(fd, &hello, sizeof hello, 0) != sizeof hello ||
+            hello.magic != NETPLAY_MAGIC || hello.version != NETPLAY_VERSION){
+            SDL_Log("Peer on %s is not a compatible netplay host\n", config->netplay_path);
+            close(fd);
+            return false;
+        }
+        if (hello.rom_hash != chip8->rom_hash){
+            SDL_Log("Netplay host is running a different ROM\n");
+            close(fd);
+            return false;
+        }
+        if (hello.platform >= SDL_arraysize(platform_defaults)){
+            SDL_Log("Netplay host sent unknown platform %u\n", hello.platform);
+            close(fd);
+            return false;
+        }
+        chip8->rng = hello.seed;
+        config->platform = hello.platform;
+        config->quirks = hello.quirks;
+        config->insts_per_second = hello.insts_per_second;
+    }
+
+    net->fd = fd;
+    SDL_Log("Netplay connected\n");
+    return true;
+}
+
+// Run frame h from its snapshot slot with the inputs known for it now
+void netplay_simulate(netplay_t *net, chip8_t *chip8, const config_t config, const uint32_t h){
+    const uint32_t slot = h % NETPLAY_RING;
+    const uint16_t remote = h < net->remote_frame ? net->remote[slot] : net->last_remote;
+    const uint16_t keys = net->local[slot] | remote;
+
+    save_chip8_state(chip8, &net->snapshots[slot]);
+    net->used[slot] = remote;
+    for (uint8_t i = 0; i < 16; i++) chip8->keypad[i] = (keys >> i) & 1;
+    emulate_frame(chip8, config, NULL, NULL);
+}
+
+// Take in remote inputs, roll back if a prediction was wrong, then run this frame.
+// Returns false if the frame was held back waiting for the peer; timers only tick for frames that ran.
+bool netplay_frame(netplay_t *net, chip8_t *chip8, const config_t config){
+    uint32_t rollback = net->frame;
+    netplay_input_t input;
+    ssize_t received;
+
+    while ((received = recv(net->fd, &input, sizeof input, MSG_DONTWAIT)) == sizeof input){
+        // Messages arrive in order, a peer never sends a frame more than NETPLAY_MAX_AHEAD past ours
+        const uint32_t slot = input.frame % NETPLAY_RING;
+        net->remote[slot] = input.keypad;
+        net->last_remote = input.keypad;
+        net->remote_frame = input.frame + 1;
+        if (input.frame < rollback && net->used[slot] != input.keypad) rollback = input.frame;
+    }
+    if (received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK)){
+        log_event("Netplay peer disconnected\n", NULL, 0, 0, 0);
+        chip8->state = QUIT;
+        return false;
+    }
+
+    if (rollback < net->frame){
+        const uint64_t start = SDL_GetPerformanceCounter();
+        load_chip8_state(chip8, &net->snapshots[rollback % NETPLAY_RING]);
+        for (uint32_t h = rollback; h < net->frame; h++){
+            netplay_simulate(net, chip8, config, h);
+            if (chip8->delay_timer > 0) chip8->delay_timer--;
+            if (chip8->sound_timer > 0) chip8->sound_timer--;
+        }
+        const uint64_t ticks = SDL_GetPerformanceCounter() - start;
+
+        const uint32_t depth = net->frame - rollback;
+        net->rollbacks++;
+        net->resimulated += depth;
+        if (depth > net->max_depth) net->max_depth = depth;
+        net->rollback_ticks += ticks;
+        if (ticks > net->max_rollback_ticks) net->max_rollback_ticks = ticks;
+    }
+
+    // Too far past the peer to roll back safely, wait for it to catch up
+    if (net->frame >= net->remote_frame + NETPLAY_MAX_AHEAD){
+        net->stalls++;
+        return false;
+    }
+
+    uint16_t local = 0;
+    for (uint8_t i = 0; i < 16; i++){
+        if (net->keypad[i]) local |= 1 << i;
+    }
+    const netplay_input_t message = {.frame = net->frame, .keypad = local};
+    if (send(net->fd, &message, sizeof message, MSG_NOSIGNAL) != sizeof message){
+        log_event("Could not send netplay input: %s\n", strerror(errno), 0, 0, 0);
+        chip8->state = QUIT;
+        return false;
+    }
+
+    net->local[net->frame % NETPLAY_RING] = local;
+    netplay_simulate(net, chip8, config, net->frame);
+    net->frame++;
+    return true;
+}
+
+void close_netplay(netplay_t *net){
+    if (net->fd < 0) return;
+    close(net->fd);
+    net->fd = -1;
+
+    const double us_per_tick = 1e6 / SDL_GetPerformanceFrequency();
+    SDL_Log("Netplay: %u frames, %llu stalled, %llu rollbacks re-running %llu frames (deepest %u)\n",
+            net->frame, (unsigned long long)net->stalls, (unsigned long long)net->rollbacks,
+            (unsigned long long)net->resimulated, net->max_depth);
+    if (net->rollbacks){
+        SDL_Log("Rollback time: %.1f us average, %.1f us worst\n",
+                net->rollback_ticks * us_per_tick / net->rollbacks, net->max_rollback_ticks * us_per_tick);
+    }
+}
+
+// Disassemble one opcode into text like "DRW V0, V1, 15", unknown opcodes come out as data
+void disassemble(const uint16_t opcode, char *text, const size_t size){
+    const uint16_t NNN = opcode & 0x0FFF;
+    const uint8_t NN = opcode & 0xFF;
+    const uint8_t N = opcode & 0xF;
+    const uint8_t X = (opcode >> 8) & 0xF;
+    const uint8_t Y = (opcode >> 4) & 0xF;
+    static const char *alu[16] = {
+        [0x0] = "LD", [0x1] = "OR", [0x2] = "AND", [0x3] = "XOR", [0x4] = "ADD",
+        [0x5] = "SUB", [0x6] = "SHR", [0x7] = "SUBN", [0xE] = "SHL",
+    };
+
+    switch (opcode >> 12){
+        case 0x0:
+            if (NN == 0xE0) snprintf(text, size, "CLS");
+            else if (NN == 0xEE) snprintf(text, size, "RET");
+            else snprintf(text, size, "SYS 0x%03X", NNN);
+            return;
+        case 0x1: snprintf(text, size, "JP 0x%03X", NNN); return;
+        case 0x2: snprintf(text, size, "CALL 0x%03X", NNN); return;
+        case 0x3: snprintf(text, size, "SE V%X, 0x%02X", X, NN); return;
+        case 0x4: snprintf(text, size, "SNE V%X, 0x%02X", X, NN); return;
+        case 0x5: if (N == 0){ snprintf(text, size, "SE V%X, V%X", X, Y); return; } break;
+        case 0x6: snprintf(text, size, "LD V%X, 0x%02X", X, NN); return;
+        case 0x7: snprintf(text, size, "ADD V%X, 0x%02X", X, NN); return;
+        case 0x8: if (alu[N]){ snprintf(text, size, "%s V%X, V%X", alu[N], X, Y); return; } break;
+        case 0x9: if (N == 0){ snprintf(text, size, "SNE V%X, V%X", X, Y); return; } break;
+        case 0xA: snprintf(text, size, "LD I, 0x%03X", NNN); return;
+        case 0xB: snprintf(text, size, "JP V0, 0x%03X", NNN); return;
+        case 0xC: snprintf(text, size, "RND V%X, 0x%02X", X, NN); return;
+        case 0xD: snprintf(text, size, "DRW V%X, V%X, %u", X, Y, N); return;
+        case 0xE:
+            if (NN == 0x9E){ snprintf(text, size, "SKP V%X", X); return; }
+            if (NN == 0xA1){ snprintf(text, size, "SKNP V%X", X); return; }
+            break;
+        case 0xF:
+            switch (NN){
+                case 0x07: snprintf(text, size, "LD V%X, DT", X); return;
+                case 0x0A: snprintf(text, size, "LD V%X, K", X); return;
+                case 0x15: snprintf(text, size, "LD DT, V%X", X); return;
+                case 0x18: snprintf(text, size, "LD ST, V%X", X); return;
+                case 0x1E: snprintf(text, size, "ADD I, V%X", X); return;
+                case 0x29: snprintf(text, size, "LD F, V%X", X); return;
+                case 0x33: snprintf(text, size, "LD B, V%X", X); return;
+                case 0x55: snprintf(text, size, "LD [I], V%X", X); return;
+                case 0x65: snprintf(text, size, "LD V%X, [I]", X); return;
+                default: break;
+            }
+            break;
+        default: break;
+    }
+    snprintf(text, size, "DW 0x%04X", opcode);
+}
+
+// Sampling profiler: a thread reads the PC the emulation loop publishes and counts hits per address
+typedef struct{
+    SDL_Thread *thread;
+    SDL_atomic_t running;
+    const chip8_t *chip8;   // The machine sampled, its address stays fixed across ROM swaps
+    uint32_t interval_ns;
+    uint64_t hits[4096];    // Samples per guest address, only touched by the profiler thread until it's joined
+    uint64_t idle;          // Samples taken between frames
+} profiler_t;
+
+int profiler_thread(void *data){
+    profiler_t *profiler = data;
+    const struct timespec interval = {
+        .tv_sec = profiler->interval_ns / 1000000000,
+        .tv_nsec = profiler->interval_ns % 1000000000,
+    };
+
+    while (SDL_AtomicGet(&profiler->running)){
+        const uint32_t pc = __atomic_load_n(&profiler->chip8->profile_pc, __ATOMIC_RELAXED);
+        if (pc & PROFILE_BUSY) profiler->hits[pc & 0xFFF]++;
+        else profiler->idle++;
+        nanosleep(&interval, NULL);
+    }
+    return 0;
+}
+
+bool start_profiler(profiler_t *profiler, const chip8_t *chip8, const uint32_t hz){
+    memset(profiler, 0, sizeof *profiler);
+    profiler->chip8 = chip8;
+    profiler->interval_ns = 1000000000 / (hz ? hz : 1);
+    SDL_AtomicSet(&profiler->running, 1);
+
+    profiler->thread = SDL_CreateThread(profiler_thread, "PC profiler", profiler);
+    if (!profiler->thread){
+        SDL_Log("Could not start the PC profiler! %s\n", SDL_GetError());
+        return false;
+    }
+    return true;
+}
+
+// Stop sampling and log the hottest guest addresses with the code currently there
+void stop_profiler(profiler_t *profiler){
+    if (!profiler->thread) return;
+    SDL_AtomicSet(&profiler->running, 0);
+    SDL_WaitThread(profiler->thread, NULL);
+    profiler->thread = NULL;
+
+    uint64_t busy = 0;
+    for (size_t i = 0; i < SDL_arraysize(profiler->hits); i++) busy += profiler->hits[i];
+    SDL_Log("PC profile: %llu samples while emulating, %llu between frames\n",
+            (unsigned long long)busy, (unsigned long long)profiler->idle);
+    if (!busy) return;
+
+    // Top addresses by repeated selection, the histogram is small and this runs once
+    bool reported[4096] = {false};
+    for (int rank = 0; rank < 20; rank++){
+        size_t top = 0;
+        for (size_t i = 1; i < SDL_arraysize(profiler->hits); i++){
+            if (!reported[i] && (reported[top] || profiler->hits[i] > profiler->hits[top])) top = i;
+        }
+        if (reported[top] || !profiler->hits[top]) break;
+        reported[top] = true;
+
+        char text[32];
+        const uint16_t opcode = (profiler->chip8->ram[top] << 8) | profiler->chip8->ram[(top + 1) & 0xFFF];
+        disassemble(opcode, text, sizeof text);
+        SDL_Log("  0x%03zX  %04X  %-18s %10llu  %5.1f%%\n", top, opcode, text,
+                (unsigned long long)profiler->hits[top], profiler->hits[top] * 100.0 / busy);
+    }
+}
+
+// Metrics endpoint: HTTP on a Unix socket (curl --unix-socket PATH http://x/metrics) serving the
+// per-instance counters in Prometheus text format. Served from its own thread, scrapes only take
+// the instance spinlocks long enough to copy the counters out
+int compare_doubles(const void *a, const void *b){
+    const double x = *(const double *)a;
+    const double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+uint64_t thread_cpu_ns(void){
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) return 0;
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Called by the emulation thread after every frame it ran
+void record_frame_metrics(instance_metrics_t *metrics, const chip8_t *chip8, const double frame_seconds,
+                          const bool presented, const uint64_t skipped){
+    const uint64_t cpu_ns = thread_cpu_ns();
+
+    SDL_AtomicLock(&metrics->lock);
+    // ROM swaps and state loads move cycles backwards, the counter only ever adds what ran since last frame
+    if (chip8->cycles > metrics->last_cycles) metrics->instructions += chip8->cycles - metrics->last_cycles;
+    metrics->last_cycles = chip8->cycles;
+    snprintf(metrics->rom_name, sizeof metrics->rom_name, "%s", chip8->rom_name ? chip8->rom_name : "");
+    metrics->frames_presented += presented;
+    metrics->frames_skipped += skipped;
+    metrics->cpu_ns = cpu_ns;
+    metrics->frame_seconds[metrics->frames++ % METRICS_FRAME_HISTORY] = frame_seconds;
+    metrics->frame_seconds_sum += frame_seconds;
+    SDL_AtomicUnlock(&metrics->lock);
+}
+
+// Prometheus label values escape backslash, double quote and newline
+void write_label_value(FILE *out, const char *value){
+    for (; *value; value++){
+        if (*value == '\\' || *value == '"') fputc('\\', out);
+        if (*value == '\n') fputs("\\n", out);
+        else fputc(*value, out);
+    }
+}
+
+void write_metric_header(FILE *out, const char *name, const char *type, const char *help){
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void write_metric_labels(FILE *out, const char *name, const uint32_t instance, const instance_metrics_t *metrics){
+    fprintf(out, "%s{instance=\"%u\",rom=\"", name, instance);
+    write_label_value(out, metrics->rom_name);
+    fputs("\"", out);
+}
+
+void write_metrics(FILE *out, const metrics_server_t *server){
+    instance_metrics_t *snapshots = malloc(server->count * sizeof *snapshots);
+    if (!snapshots) return;
+    for (uint32_t i = 0; i < server->count; i++){
+        SDL_AtomicLock(&server->instances[i]->lock);
+        snapshots[i] = *server->instances[i];
+        SDL_AtomicUnlock(&server->instances[i]->lock);
+    }
+
+    // Counters
+    static const struct{
+        const char *name;
+        const char *help;
+        size_t offset;
+    } counters[] = {
+        {"chip8_instructions_total", "Emulated instructions executed.", offsetof(instance_metrics_t, instructions)},
+        {"chip8_frames_presented_total", "Frames handed to the display.", offsetof(instance_metrics_t, frames_presented)},
+        {"chip8_frames_skipped_total", "60hz frame slots missed because a frame ran long.", offsetof(instance_metrics_t, frames_skipped)},
+    };
+    for (size_t c = 0; c < SDL_arraysize(counters); c++){
+        write_metric_header(out, counters[c].name, "counter", counters[c].help);
+        for (uint32_t i = 0; i < server->count; i++){
+            write_metric_labels(out, counters[c].name, i, &snapshots[i]);
+            fprintf(out, "} %llu\n", (unsigned long long)*(const uint64_t *)((const uint8_t *)&snapshots[i] + counters[c].offset));
+        }
+    }
+
+    write_metric_header(out, "chip8_thread_cpu_seconds_total", "counter", "CPU time of the emulation thread.");
+    for (uint32_t i = 0; i < server->count; i++){
+        write_metric_labels(out, "chip8_thread_cpu_seconds_total", i, &snapshots[i]);
+        fprintf(out, "} %.9f\n", snapshots[i].cpu_ns / 1e9);
+    }
+
+    // Percentiles over the last METRICS_FRAME_HISTORY frames, sum and count over every frame
+    static const double quantiles[] = {0.5, 0.95, 0.99};
+    write_metric_header(out, "chip8_frame_time_seconds", "summary", "Time spent emulating and presenting a frame.");
+    for (uint32_t i = 0; i < server->count; i++){
+        instance_metrics_t *metrics = &snapshots[i];
+        const uint64_t history = metrics->frames < METRICS_FRAME_HISTORY ? metrics->frames : METRICS_FRAME_HISTORY;
+        qsort(metrics->frame_seconds, history, sizeof *metrics->frame_seconds, compare_doubles);
+        for (size_t q = 0; history && q < SDL_arraysize(quantiles); q++){
+            write_metric_labels(out, "chip8_frame_time_seconds", i, metrics);
+            fprintf(out, ",quantile=\"%g\"} %.9f\n", quantiles[q], metrics->frame_seconds[(size_t)(quantiles[q] * (history - 1))]);
+        }
+        write_metric_labels(out, "chip8_frame_time_seconds_sum", i, metrics);
+        fprintf(out, "} %.9f\n", metrics->frame_seconds_sum);
+        write_metric_labels(out, "chip8_frame_time_seconds_count", i, metrics);
+        fprintf(out, "} %llu\n", (unsigned long long)metrics->frames);
+    }
+
+    // Memory is shared by every instance in the process
+    long pages = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm){
+        if (fscanf(statm, "%*s %ld", &pages) != 1) pages = 0;
+        fclose(statm);
+    }
+    write_metric_header(out, "process_resident_memory_bytes", "gauge", "Resident set size of the emulator process.");
+    fprintf(out, "process_resident_memory_bytes %lld\n", (long long)pages * sysconf(_SC_PAGESIZE));
+    free(snapshots);
+}
+
+// Answer one scrape, whatever the request asks for
+void serve_metrics(const metrics_server_t *server, const int fd){
+    // A client that connects and never sends a request must not hold the metrics thread
+    struct pollfd client = {.fd = fd, .events = POLLIN};
+    if (poll(&client, 1, METRICS_REQUEST_TIMEOUT_MS) <= 0) return;
+
+    char request[1024];
+    if (recv(fd, request, sizeof request, MSG_DONTWAIT) <= 0) return;
+
+    char *body = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&body, &size);
+    if (!out) return;
+    write_metrics(out, server);
+    if (fclose(out) != 0){
+        free(body);
+        return;
+    }
+
+    char header[160];
+    const int header_len = snprintf(header, sizeof header, "HTTP/1.0 200 OK\r\n"
+                                    "Content-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", size);
+    if (send(fd, header, header_len, MSG_NOSIGNAL) == header_len){
+        for (size_t sent = 0; sent < size;){
+            const ssize_t n = send(fd, body + sent, size - sent, MSG_NOSIGNAL);
+            if (n <= 0) break;
+            sent += n;
+        }
+    }
+    free(body);
+}
+
+int metrics_thread(void *data){
+    metrics_server_t *server = data;
+
+    // Wake up now and then to notice stop_metrics
+    while (SDL_AtomicGet(&server->running)){
+        struct pollfd pfd = {.fd = server->fd, .events = POLLIN};
+        if (poll(&pfd, 1, 100) <= 0) continue;
+
+        const int client = accept(server->fd, NULL, NULL);
+        if (client < 0) continue;
+        serve_metrics(server, client);
+        close(client);
+    }
+    return 0;
+}
+
+bool start_metrics(metrics_server_t *server, const char *path, instance_metrics_t *instances[], const uint32_t count){
+    server->path = path;
+    server->count = count;
+    memcpy(server->instances, instances, count * sizeof *instances);
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof addr.sun_path){
+        SDL_Log("Metrics socket path %s is too long\n", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+
+    server->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server->fd < 0){
+        SDL_Log("Could not create metrics socket: %s\n", strerror(errno));
+        return false;
+    }
+    unlink(path);
+    if (bind(server->fd, (struct sockaddr *)&addr, sizeof addr) != 0 || listen(server->fd, 4) != 0){
+        SDL_Log("Could not listen on %s: %s\n", path, strerror(errno));
+        close(server->fd);
+        server->fd = -1;
+        return false;
+    }
+
+    SDL_AtomicSet(&server->running, 1);
+    server->thread = SDL_CreateThread(metrics_thread, "metrics", server);
+    if (!server->thread){
+        SDL_Log("Could not start the metrics thread! %s\n", SDL_GetError());
+        close(server->fd);
+        server->fd = -1;
+        unlink(path);
+        return false;
+    }
+    SDL_Log("Serving metrics on %s\n", path);
+    return true;
+}
+
+void stop_metrics(metrics_server_t *server){
+    if (!server->thread) return;
+    SDL_AtomicSet(&server->running, 0);
+    SDL_WaitThread(server->thread, NULL);
+    server->thread = NULL;
+    close(server->fd);
+    server->fd = -1;
+    unlink(server->path);
+}
+
+int rom_loader_thread(void *data){
+    rom_loader_t *loader = data;
+    tune_thread("loader", -1, 0); // Off the emulation CPU and priority it inherited
+
+    chip8_t *chip8 = calloc(1, sizeof *chip8);
+    const bool ok = chip8 && (loader->from_image ?
+        init_chip8_from_memory(chip8, loader->config, loader->image, loader->image_size, loader->rom_name) :
+        init_chip8(chip8, loader->config, loader->rom_name));
+    if (chip8 && !ok){
+        free(chip8);
+        chip8 = NULL;
+    }
+
+    loader->result = chip8;
+    SDL_AtomicSet(&loader->state, LOADER_DONE);
+    return 0;
+}
+
+// Swap in a finished load and start the next requested one, returns true if chip8 was replaced
+bool update_rom_loader(rom_loader_t *loader, chip8_t *chip8, const config_t config){
+    bool swapped = false;
+
+    if (SDL_AtomicGet(&loader->state) == LOADER_DONE){
+        SDL_WaitThread(loader->thread, NULL);
+        loader->thread = NULL;
+
+        if (loader->result){
+            // Replace the whole machine between frames, the old ROM never sees the new one
+            *chip8 = *loader->result;
+            free(loader->result);
+            loader->result = NULL;
+
+            SDL_free(loader->current_name);
+            loader->current_name = loader->rom_name;
+            if (!loader->from_image) loader->image = NULL; // A file replaced the pack ROM
+            swapped = true;
+        }
+        else{
+            SDL_free(loader->rom_name);
+        }
+        loader->rom_name = NULL;
+        SDL_AtomicSet(&loader->state, LOADER_IDLE);
+    }
+
+    if (loader->request && SDL_AtomicGet(&loader->state) == LOADER_IDLE){
+        loader->rom_name = loader->request;
+        loader->request = NULL;
+        loader->from_image = loader->request_reload && loader->image;
+        loader->config = config;
+        SDL_AtomicSet(&loader->state, LOADER_BUSY);
+
+        loader->thread = SDL_CreateThread(rom_loader_thread, "rom_loader", loader);
+        if (!loader->thread){
+            SDL_Log("Could not start ROM loader thread %s\n", SDL_GetError());
+            SDL_free(loader->rom_name);
+            loader->rom_name = NULL;
+            SDL_AtomicSet(&loader->state, LOADER_IDLE);
+        }
+    }
+
+    return swapped;
+}
+
+void destroy_rom_loader(rom_loader_t *loader){
+    if (loader->thread) SDL_WaitThread(loader->thread, NULL);
+    free(loader->result);
+    SDL_free(loader->request);
+    SDL_free(loader->rom_name);
+    SDL_free(loader->current_name);
+}
+
+// On-disk ROM library index: header, entries sorted by hash, then file names
+#define LIBRARY_INDEX_NAME ".chip8_library"
+#define LIBRARY_MAGIC 0x424C3843u // "C8LB"
+#define LIBRARY_VERSION 1
+#define LIBRARY_MAX_ROM_SIZE (65536 - 0x200)
+
+typedef struct{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t names_size;
+} library_header_t;
+
+typedef struct{
+    uint64_t hash;     // hash64 of the ROM contents
+    int64_t mtime;     // Modification time when hashed, unchanged files are not re-read on rescans
+    uint32_t size;
+    uint32_t name;     // Offset of the file name in the names table
+    uint32_t platform;
+    uint32_t quirks;
+    uint32_t insts_per_second;
+    uint32_t reserved;
+} library_entry_t;
+
+typedef struct{
+    const char *dir;
+    void *index;               // Whole index file, entries and names point into it
+    library_entry_t *entries;  // Sorted by hash
+    uint32_t count;
+    const char *names;
+    uint32_t names_size;
+} library_t;
+
+// Guess the platform from the extension, anything too big for 4K of RAM is XO-CHIP
+platform_t detect_platform(const char *name, const size_t size){
+    const char *ext = strrchr(name, '.');
+    if (size > 4096 - 0x200) return PLATFORM_XOCHIP;
+    if (ext && strcmp(ext, ".xo8") == 0) return PLATFORM_XOCHIP;
+    if (ext && strcmp(ext, ".sc8") == 0) return PLATFORM_SUPERCHIP;
+    return PLATFORM_CHIP8;
+}
+
+bool is_rom_file(const char *name){
+    const char *ext = strrchr(name, '.');
+    return ext && (strcmp(ext, ".ch8") == 0 || strcmp(ext, ".sc8") == 0 || strcmp(ext, ".xo8") == 0);
+}
+
+void close_library(library_t *library){
+    free(library->index);
+    library->index = NULL;
+    library->entries = NULL;
+    library->names = NULL;
+    library->count = 0;
+    library->names_size = 0;
+}
+
+// Read the index file in one go, false if missing or stale format
+bool load_library_index(library_t *library){
+    char path[4096];
+    snprintf(path, sizeof path, "%s/%s", library->dir, LIBRARY_INDEX_NAME);
+
+    FILE *file = fopen(path, "rb");
+    if (!file) return false;
+
+    fseek(file, 0, SEEK_END);
+    const long file_size = ftell(file);
+    rewind(file);
+
+    library_header_t *header = NULL;
+    if (file_size >= (long)sizeof *header) header = malloc(file_size);
+    if (!header || fread(header, file_size, 1, file) != 1 ||
+        header->magic != LIBRARY_MAGIC || header->version != LIBRARY_VERSION ||
+        sizeof *header + (uint64_t)header->count * sizeof(library_entry_t) + header->names_size != (uint64_t)file_size){
+        free(header);
+        fclose(file);
+        return false;
+    }
+    fclose(file);
+
+    close_library(library);
+    library->index = header;
+    library->count = header->count;
+    library->names_size = header->names_size;
+    library->entries = (library_entry_t *)(header + 1);
+    library->names = (const char *)(library->entries + header->count);
+    return library->names_size == 0 || library->names[library->names_size - 1] == '\0';
+}
+
+const library_entry_t *library_find_hash(const library_t *library, const uint64_t hash){
+    uint32_t lo = 0, hi = library->count;
+    while (lo < hi){
+        const uint32_t mid = lo + (hi - lo) / 2;
+        if (library->entries[mid].hash < hash) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < library->count && library->entries[lo].hash == hash ? &library->entries[lo] : NULL;
+}
+
+int compare_library_entries(const void *a, const void *b){
+    const uint64_t ha = ((const library_entry_t *)a)->hash;
+    const uint64_t hb = ((const library_entry_t *)b)->hash;
+    return (ha > hb) - (ha < hb);
+}
+
+// Old entries by file name, so a rescan finds unchanged files with a binary search
+typedef struct{
+    const char *name;
+    const library_entry_t *entry;
+} library_name_t;
+
+int compare_library_names(const void *a, const void *b){
+    return strcmp(((const library_name_t *)a)->name, ((const library_name_t *)b)->name);
+}
+
+// Rescan the library directory, re-hashing only new or modified ROMs, and rewrite the index
+bool scan_library(library_t *library){
+    DIR *dir = opendir(library->dir);
+    if (!dir){
+        SDL_Log("Could not open ROM library %s\n", library->dir);
+        return false;
+    }
+
+    library_header_t header = {.magic = LIBRARY_MAGIC, .version = LIBRARY_VERSION};
+    library_entry_t *entries = NULL;
+    char *names = NULL;
+    uint32_t capacity = 0, names_capacity = 0, hashed = 0;
+    uint8_t *rom = malloc(LIBRARY_MAX_ROM_SIZE);
+    library_name_t *old_names = malloc((library->count ? library->count : 1) * sizeof *old_names);
+    bool ok = rom && old_names;
+    for (uint32_t i = 0; ok && i < library->count; i++){
+        old_names[i] = (library_name_t){&library->names[library->entries[i].name], &library->entries[i]};
+    }
+    if (ok) qsort(old_names, library->count, sizeof *old_names, compare_library_names);
+
+    struct dirent *dirent;
+    while (ok && (dirent = readdir(dir))){
+        if (!is_rom_file(dirent->d_name)) continue;
+
+        char path[4096];
+        struct stat st;
+        snprintf(path, sizeof path, "%s/%s", library->dir, dirent->d_name);
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > LIBRARY_MAX_ROM_SIZE) continue;
+
+        const size_t name_len = strlen(dirent->d_name) + 1;
+        if (header.count == capacity){
+            capacity = capacity ? capacity * 2 : 256;
+            library_entry_t *grown = realloc(entries, capacity * sizeof *entries);
+            if (!grown){ ok = false; break; }
+            entries = grown;
+        }
+        if (header.names_size + name_len > names_capacity){
+            names_capacity = (header.names_size + name_len) * 2;
+            char *grown = realloc(names, names_capacity);
+            if (!grown){ ok = false; break; }
+            names = grown;
+        }
+
+        library_entry_t *entry = &entries[header.count];
+        const library_name_t key = {.name = dirent->d_name};
+        const library_name_t *found = library->count ?
+            bsearch(&key, old_names, library->count, sizeof *old_names, compare_library_names) : NULL;
+        const library_entry_t *old = found ? found->entry : NULL;
+        if (old && old->size == (uint32_t)st.st_size && old->mtime == (int64_t)st.st_mtime){
+            *entry = *old;
+        }
+        else{
+            FILE *file = fopen(path, "rb");
+            if (!file) continue;
+            const size_t size = fread(rom, 1, st.st_size, file);
+            fclose(file);
+            if (size != (size_t)st.st_size) continue;
+
+            const platform_t platform = detect_platform(dirent->d_name, size);
+            *entry = (library_entry_t){
+                .hash = hash64(rom, size, 0),
+                .mtime = st.st_mtime,
+                .size = size,
+                .platform = platform,
+                .quirks = platform_defaults[platform].quirks,
+                .insts_per_second = platform_defaults[platform].insts_per_second,
+            };
+            hashed++;
+        }
+
+        entry->name = header.names_size;
+        memcpy(&names[header.names_size], dirent->d_name, name_len);
+        header.names_size += name_len;
+        header.count++;
+    }
+    closedir(dir);
+    free(rom);
+    free(old_names);
+
+    if (ok){
+        qsort(entries, header.count, sizeof *entries, compare_library_entries);
+
+        // Write next to the old index and rename over it so readers never see a partial file
+        char path[4096], tmp_path[sizeof path + sizeof ".tmp"];
+        snprintf(path, sizeof path, "%s/%s", library->dir, LIBRARY_INDEX_NAME);
+        snprintf(tmp_path, sizeof tmp_path, "%s.tmp", path);
+
+        FILE *file = fopen(tmp_path, "wb");
+        ok = file &&
+             fwrite(&header, sizeof header, 1, file) == 1 &&
+             fwrite(entries, sizeof *entries, header.count, file) == header.count &&
+             fwrite(names, 1, header.names_size, file) == header.names_size;
+        if (file && fclose(file) != 0) ok = false;
+        if (ok && rename(tmp_path, path) != 0) ok = false;
+        if (!ok) SDL_Log("Could not write ROM library index %s\n", path);
+    }
+    free(entries);
+    free(names);
+
+    if (!ok) return false;
+    SDL_Log("ROM library %s: %u ROMs, %u hashed\n", library->dir, header.count, hashed);
+    return load_library_index(library);
+}
+
+bool open_library(library_t *library, const char *dir){
+    library->dir = dir;
+    return load_library_index(library) || scan_library(library);
+}
+
+// Apply the per-ROM settings stored in the library to a loaded ROM, found by the hash it was loaded with.
+// A ROM in the library directory that isn't indexed yet triggers one rescan, other ROMs keep their defaults
+bool library_apply(library_t *library, const chip8_t *chip8, config_t *config){
+    if (!library->dir) return false;
+
+    const char *rom_name = chip8->rom_name;
+    const uint64_t hash = chip8->rom_hash;
+    const char *slash = strrchr(rom_name, '/');
+    const char *name = slash ? slash + 1 : rom_name;
+
+    const library_entry_t *entry = library_find_hash(library, hash);
+    if (!entry){
+        // Same file as <library>/<name>, so the index is missing it or is out of date
+        char path[4096];
+        struct stat rom_st, lib_st;
+        snprintf(path, sizeof path, "%s/%s", library->dir, name);
+        if (!is_rom_file(name) || stat(rom_name, &rom_st) != 0 || stat(path, &lib_st) != 0 ||
+            rom_st.st_dev != lib_st.st_dev || rom_st.st_ino != lib_st.st_ino) return false;
+
+        if (!scan_library(library)) return false;
+        entry = library_find_hash(library, hash);
+        if (!entry) return false;
+    }
+
+    config->platform = entry->platform < SDL_arraysize(platform_defaults) ? entry->platform : PLATFORM_CHIP8;
+    config->quirks = entry->quirks;
+    config->insts_per_second = entry->insts_per_second;
+    SDL_Log("ROM %s (%016llx): %s, quirks 0x%02x, %u IPS\n", name, (unsigned long long)entry->hash,
+            platform_defaults[config->platform].name, config->quirks, config->insts_per_second);
+    return true;
+}
+
+// ROM pack archive: header, fixed size index, then the ROM images back to back
+#define ROM_PACK_MAGIC 0x4B503843u // "C8PK"
+#define ROM_PACK_VERSION 1
+
+typedef struct{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t reserved;
+} rom_pack_header_t;
+
+typedef struct{
+    uint64_t hash;   // hash64 of the ROM image
+    uint32_t offset; // From the start of the file
+    uint32_t size;
+    char name[48];   // File name without directory, NUL terminated
+} rom_pack_entry_t;
+
+typedef struct{
+    const uint8_t *data; // Whole archive mapped read-only
+    size_t size;
+    const rom_pack_entry_t *entries;
+    uint32_t count;
+} rom_pack_t;
+
+// Map a ROM pack and check the index once, ROM images are then copied straight from the mapping
+bool open_rom_pack(rom_pack_t *pack, const char *path){
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0){
+        SDL_Log("Could not open ROM pack %s\n", path);
+        return false;
+    }
+
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(rom_pack_header_t)){
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED){
+        SDL_Log("Could not map ROM pack %s\n", path);
+        return false;
+    }
+
+    const rom_pack_header_t *header = data;
+    pack->data = data;
+    pack->size = st.st_size;
+    pack->entries = (const rom_pack_entry_t *)(header + 1);
+    pack->count = header->count;
+
+    bool ok = header->magic == ROM_PACK_MAGIC && header->version == ROM_PACK_VERSION &&
+              sizeof *header + (uint64_t)header->count * sizeof(rom_pack_entry_t) <= pack->size;
+    for (uint32_t i = 0; ok && i < pack->count; i++){
+        const rom_pack_entry_t *entry = &pack->entries[i];
+        ok = (uint64_t)entry->offset + entry->size <= pack->size && memchr(entry->name, '\0', sizeof entry->name);
+    }
+    if (!ok){
+        SDL_Log("ROM pack %s is corrupt\n", path);
+        munmap(data, pack->size);
+        memset(pack, 0, sizeof *pack);
+        return false;
+    }
+    return true;
+}
+
+void close_rom_pack(rom_pack_t *pack){
+    if (pack->data) munmap((void *)pack->data, pack->size);
+    memset(pack, 0, sizeof *pack);
+}
+
+const rom_pack_entry_t *rom_pack_find(const rom_pack_t *pack, const char *name){
+    const char *slash = strrchr(name, '/');
+    if (slash) name = slash + 1;
+
+    for (uint32_t i = 0; i < pack->count; i++){
+        if (strcmp(pack->entries[i].name, name) == 0) return &pack->entries[i];
+    }
+    return NULL;
+}
+
+bool init_chip8_from_pack(chip8_t *chip8, const config_t config, const rom_pack_t *pack,
+                          const rom_pack_entry_t *entry){
+    return init_chip8_from_memory(chip8, config, &pack->data[entry->offset], entry->size, entry->name);
+}
+
+// Build a ROM pack from individual ROM files
+bool write_rom_pack(const char *path, char **rom_names, const int count){
+    rom_pack_header_t header = {.magic = ROM_PACK_MAGIC, .version = ROM_PACK_VERSION, .count = count};
+    rom_pack_entry_t *entries = calloc(count ? count : 1, sizeof *entries);
+    uint8_t *rom = malloc(65536);
+    FILE *out = fopen(path, "wb");
+    bool ok = entries && rom && out;
+
+    // Index goes first, so images are written after a placeholder and the index is filled in on the way
+    uint32_t offset = sizeof header + count * sizeof *entries;
+    if (ok && fseek(out, offset, SEEK_SET) != 0) ok = false;
+
+    for (int i = 0; ok && i < count; i++){
+        const char *slash = strrchr(rom_names[i], '/');
+        const char *name = slash ? slash + 1 : rom_names[i];
+        if (strlen(name) >= sizeof entries[i].name){
+            SDL_Log("ROM name %s is too long for a ROM pack\n", name);
+            ok = false;
+            break;
+        }
+
+        FILE *file = fopen(rom_names[i], "rb");
+        if (!file){
+            SDL_Log("ROM file %s invalid or does not exist\n", rom_names[i]);
+            ok = false;
+            break;
+        }
+        const size_t size = fread(rom, 1, 65536, file);
+        const bool too_big = fgetc(file) != EOF;
+        fclose(file);
+        if (too_big){
+            SDL_Log("ROM file %s is too big\n", rom_names[i]);
+            ok = false;
+            break;
+        }
+
+        entries[i].hash = hash64(rom, size, 0);
+        entries[i].offset = offset;
+        entries[i].size = size;
+        strcpy(entries[i].name, name);
+        ok = fwrite(rom, 1, size, out) == size;
+        offset += size;
+    }
+
+    if (ok){
+        rewind(out);
+        ok = fwrite(&header, sizeof header, 1, out) == 1 &&
+             fwrite(entries, sizeof *entries, count, out) == (size_t)count;
+    }
+    if (out && fclose(out) != 0) ok = false;
+    free(entries);
+    free(rom);
+
+    if (!ok){
+        SDL_Log("Could not write ROM pack %s\n", path);
+        remove(path);
+        return false;
+    }
+    SDL_Log("Wrote %d ROMs to %s\n", count, path);
+    return true;
+}
+
+// Stress ROMs: endless loops that each hammer one part of the interpreter, for benchmarking
+typedef struct{
+    uint8_t code[4096 - 0x200];
+    uint16_t size;
+} rom_builder_t;
+
+// Append one opcode, big endian like every CHIP-8 instruction
+void emit_opcode(rom_builder_t *rom, const uint16_t opcode){
+    rom->code[rom->size++] = opcode >> 8;
+    rom->code[rom->size++] = opcode & 0xFF;
+}
+
+// Address the next emitted opcode will load at
+uint16_t next_address(const rom_builder_t *rom){
+    return 0x200 + rom->size;
+}
+
+// Sprites of every height at positions that walk across the edges, so wrapping and clipping both run
+void build_stress_draw(rom_builder_t *rom){
+    emit_opcode(rom, 0x00E0);
+    emit_opcode(rom, 0xA000); // Font data is a handy sprite source
+    const uint16_t loop = next_address(rom);
+    for (uint8_t n = 1; n <= 15; n++){
+        emit_opcode(rom, 0xD010 | n); // DXYN with V0, V1
+        emit_opcode(rom, 0x7007);
+        emit_opcode(rom, 0x7103);
+    }
+    emit_opcode(rom, 0x1000 | loop);
+}
+
+// BCD and register dumps/loads at an address moving through a scratch area
+void build_stress_memory(rom_builder_t *rom){
+    const uint16_t loop = next_address(rom);
+    emit_opcode(rom, 0xAE00);
+    emit_opcode(rom, 0xF61E); // I = 0xE00 + V6
+    emit_opcode(rom, 0xF633); // BCD of V6
+    emit_opcode(rom, 0xAE00);
+    emit_opcode(rom, 0xF61E);
+    emit_opcode(rom, 0xFF55); // Dump V0-VF
+    emit_opcode(rom, 0xAE00);
+    emit_opcode(rom, 0xF51E);
+    emit_opcode(rom, 0xFE65); // Load V0-VE, V6 is reloaded from somewhere else
+    emit_opcode(rom, 0x7F01);
+    emit_opcode(rom, 0x86F0); // V6 = VF, keeps the offset moving
+    emit_opcode(rom, 0x7507);
+    emit_opcode(rom, 0x1000 | loop);
+}
+
+// Call chain exactly as deep as the 12 entry stack
+void build_stress_calls(rom_builder_t *rom){
+    // main: call sub 1, jump back. Sub k calls sub k+1, the last one bumps V0
+    const uint16_t main_loop = next_address(rom);
+    const uint16_t first_sub = main_loop + 4;
+    emit_opcode(rom, 0x2000 | first_sub);
+    emit_opcode(rom, 0x1000 | main_loop);
+    for (uint8_t depth = 1; depth < 12; depth++){
+        emit_opcode(rom, 0x2000 | (next_address(rom) + 4));
+        emit_opcode(rom, 0x00EE);
+    }
+    emit_opcode(rom, 0x7001);
+    emit_opcode(rom, 0x00EE);
+}
+
+// Skips driven by the bits of a counter, so taken and not taken branches mix
+void build_stress_branches(rom_builder_t *rom){
+    const uint16_t loop = next_address(rom);
+    emit_opcode(rom, 0x7025);
+    emit_opcode(rom, 0x8200); // V2 = V0
+    for (uint8_t bit = 0; bit < 8; bit++){
+        emit_opcode(rom, 0x8226); // VF = low bit of V2, X == Y so the shift quirk doesn't matter
+        emit_opcode(rom, 0x3F01);
+        emit_opcode(rom, 0x7301);
+        emit_opcode(rom, 0x9340);
+        emit_opcode(rom, 0x7401);
+        emit_opcode(rom, 0x5230);
+        emit_opcode(rom, 0x6400);
+    }
+    emit_opcode(rom, 0x1000 | loop);
+}
+
+// Rewrites its own code every iteration: an FX55 stores a fresh 6XNN over an instruction ahead of it
+void build_stress_selfmod(rom_builder_t *rom){
+    const uint16_t loop = next_address(rom);
+    const uint16_t patched = loop + 10;
+    emit_opcode(rom, 0xA000 | patched);
+    emit_opcode(rom, 0x6065);      // High byte of 65NN
+    emit_opcode(rom, 0x8160);      // Low byte is the counter
+    emit_opcode(rom, 0xF155);
+    emit_opcode(rom, 0x7601);
+    emit_opcode(rom, 0x6500);      // Patched into V5 = counter
+    emit_opcode(rom, 0x8754);      // V7 += V5
+    emit_opcode(rom, 0x1000 | loop);
+}
+
+static const struct{
+    const char *name;
+    void (*build)(rom_builder_t *rom);
+} stress_roms[] = {
+    {"stress_draw.ch8", build_stress_draw},
+    {"stress_memory.ch8", build_stress_memory},
+    {"stress_calls.ch8", build_stress_calls},
+    {"stress_branches.ch8", build_stress_branches},
+    {"stress_selfmod.ch8", build_stress_selfmod},
+};
+
+bool write_stress_roms(const char *dir){
+    for (size_t i = 0; i < SDL_arraysize(stress_roms); i++){
+        rom_builder_t rom = {0};
+        stress_roms[i].build(&rom);
+
+        char path[4096];
+        snprintf(path, sizeof path, "%s/%s", dir, stress_roms[i].name);
+        FILE *out = fopen(path, "wb");
+        bool ok = out && fwrite(rom.code, 1, rom.size, out) == rom.size;
+        if (out && fclose(out) != 0) ok = false;
+        if (!ok){
+            SDL_Log("Could not write stress ROM %s\n", path);
+            return false;
+        }
+    }
+    SDL_Log("Wrote %u stress ROMs to %s\n", (unsigned)SDL_arraysize(stress_roms), dir);
+    return true;
+}
+
+// One benchmark run, stored as a JSON line in the history file
+typedef struct{
+    char host[64];
+    char compiler[128];
+    char commit[48];
+    char rom[256];
+    char platform[16];
+    char core[16];
+    uint32_t repetitions; // Runs the medians below were taken over
+    uint64_t frames; // Frames timed one by one per run
+    uint64_t instructions; // Instructions timed as one batch per run
+    double ns_per_instruction;
+    double frame_p50_us;
+    double frame_p95_us;
+    double frame_p99_us;
+    double frame_max_us;
+} bench_result_t;
+
+// Write a string as a JSON string, escaping what our values can contain
+void write_json_string(FILE *out, const char *str){
+    fputc('"', out);
+    for (; *str; str++){
+        if (*str == '"' || *str == '\\') fputc('\\', out);
+        if ((unsigned char)*str >= 0x20) fputc(*str, out);
+    }
+    fputc('"', out);
+}
+
+// Read back a string field from one of our own JSON lines, false if it's missing
+bool read_json_string(const char *line, const char *key, char *value, const size_t size){
+    char pattern[64];
+    snprintf(pattern, sizeof pattern, "\"%s\":\"", key);
+    const char *str = strstr(line, pattern);
+    if (!str) return false;
+
+    size_t len = 0;
+    for (str += strlen(pattern); *str && *str != '"' && len + 1 < size; str++){
+        if (*str == '\\' && str[1]) str++;
+        value[len++] = *str;
+    }
+    value[len] = '\0';
+    return true;
+}
+
+bool read_json_number(const char *line, const char *key, double *value){
+    char pattern[64];
+    snprintf(pattern, sizeof pattern, "\"%s\":", key);
+    const char *str = strstr(line, pattern);
+    if (!str) return false;
+    *value = strtod(str + strlen(pattern), NULL);
+    return true;
+}
+
+bool append_bench_history(const char *path, const bench_result_t *result){
+    FILE *out = fopen(path, "a");
+    if (!out){
+        SDL_Log("Could not open benchmark history %s\n", path);
+        return false;
+    }
+
+    const struct{ const char *key; const char *value; } strings[] = {
+        {"host", result->host}, {"compiler", result->compiler}, {"commit", result->commit},
+        {"rom", result->rom}, {"platform", result->platform}, {"core", result->core},
+    };
+    fputc('{', out);
+    for (size_t i = 0; i < SDL_arraysize(strings); i++){
+        fprintf(out, "\"%s\":", strings[i].key);
+        write_json_string(out, strings[i].value);
+        fputc(',', out);
+    }
+    fprintf(out, "\"time\":%lld,\"repetitions\":%u,\"frames\":%llu,\"instructions\":%llu,\"ns_per_instruction\":%.3f,"
+            "\"frame_p50_us\":%.3f,\"frame_p95_us\":%.3f,\"frame_p99_us\":%.3f,\"frame_max_us\":%.3f}\n",
+            (long long)time(NULL), result->repetitions, (unsigned long long)result->frames, (unsigned long long)result->instructions,
+            result->ns_per_instruction, result->frame_p50_us, result->frame_p95_us, result->frame_p99_us,
+            result->frame_max_us);
+
+    if (fclose(out) != 0){
+        SDL_Log("Could not write benchmark history %s\n", path);
+        return false;
+    }
+    return true;
+}
+
+// Lower is better for every metric, false if now is slower than tolerance percent over then
+bool check_bench_metric(const char *name, const double now, const double then, const double tolerance){
+    const double change = then > 0 ? (now - then) * 100.0 / then : 0;
+    const bool regressed = change > tolerance;
+    SDL_Log("  %-20s %10.3f vs %10.3f  %+6.1f%%%s\n", name, now, then, change, regressed ? "  REGRESSION" : "");
+    return !regressed;
+}
+
+// Compare against the last baseline entry for the same host, ROM, platform and core.
+// Returns false if any metric got slower by more than tolerance percent.
+bool check_bench_baseline(const char *path, const bench_result_t *result, const double tolerance){
+    FILE *file = fopen(path, "r");
+    if (!file && errno == ENOENT){
+        // First run against a history file that doesn't exist yet
+        SDL_Log("No baseline for %s yet, %s does not exist\n", result->rom, path);
+        return true;
+    }
+    if (!file){
+        SDL_Log("Could not open benchmark baseline %s\n", path);
+        return false;
+    }
+
+    bench_result_t baseline = {0};
+    bool found = false;
+    char line[2048];
+    while (fgets(line, sizeof line, file)){
+        bench_result_t entry = {0};
+        if (!read_json_string(line, "host", entry.host, sizeof entry.host) ||
+            !read_json_string(line, "rom", entry.rom, sizeof entry.rom) ||
+            !read_json_string(line, "platform", entry.platform, sizeof entry.platform) ||
+            !read_json_string(line, "core", entry.core, sizeof entry.core)) continue;
+        if (strcmp(entry.host, result->host) != 0 || strcmp(entry.rom, result->rom) != 0 ||
+            strcmp(entry.platform, result->platform) != 0 || strcmp(entry.core, result->core) != 0) continue;
+
+        read_json_string(line, "commit", entry.commit, sizeof entry.commit);
+        if (!read_json_number(line, "ns_per_instruction", &entry.ns_per_instruction) ||
+            !read_json_number(line, "frame_p50_us", &entry.frame_p50_us) ||
+            !read_json_number(line, "frame_p99_us", &entry.frame_p99_us)) continue;
+        baseline = entry; // Later lines are newer
+        found = true;
+    }
+    fclose(file);
+
+    if (!found){
+        SDL_Log("No baseline for %s (%s, %s core) on %s in %s\n", result->rom, result->platform, result->core,
+                result->host, path);
+        return true;
+    }
+
+    SDL_Log("Against baseline from commit %s (tolerance %.1f%%):\n", baseline.commit, tolerance);
+    bool ok = check_bench_metric("ns_per_instruction", result->ns_per_instruction, baseline.ns_per_instruction, tolerance);
+    ok &= check_bench_metric("frame_p50_us", result->frame_p50_us, baseline.frame_p50_us, tolerance);
+    ok &= check_bench_metric("frame_p99_us", result->frame_p99_us, baseline.frame_p99_us, tolerance);
+    return ok;
+}
+
+#define BENCH_REPETITIONS 7 // Timed runs of every --bench measurement, the median is what gets reported
+#define BENCH_BATCH_INSTRUCTIONS 2000000 // At least this many instructions are timed as one batch for ns/instruction
+
+// One frame with the timers ticking like the main loop does
+void bench_frame(chip8_t *chip8, const config_t config){
+    emulate_frame(chip8, config, NULL, NULL);
+    if (chip8->delay_timer > 0) chip8->delay_timer--;
+    if (chip8->sound_timer > 0) chip8->sound_timer--;
+}
+
+// Run frames back to back without SDL. Throughput is timed over large batches of frames, since a frame
+// is only a dozen instructions on most platforms, and frame times over bench_frames frames timed one by one.
+// Both are repeated from the same warmed up machine and the medians reported. Returns false on a regression or error.
+bool run_benchmark(chip8_t *chip8, const config_t config){
+    const uint32_t warmup = 60; // Not timed, lets caches and branch predictors settle
+    const uint32_t repetitions = BENCH_REPETITIONS;
+    double *frame_ns = malloc(config.bench_frames * sizeof *frame_ns);
+    if (!frame_ns) return false;
+
+    chip8->rng = 1; // Same CXNN sequence on every run so results stay comparable
+    for (uint32_t i = 0; i < warmup && chip8->state == RUNNING; i++) bench_frame(chip8, config);
+    static chip8_t start; // Machine every repetition starts from, too large for the stack
+    start = *chip8;
+
+    const double ns_per_tick = 1e9 / SDL_GetPerformanceFrequency();
+    double ns_per_instruction[BENCH_REPETITIONS], p50[BENCH_REPETITIONS], p95[BENCH_REPETITIONS];
+    double p99[BENCH_REPETITIONS], max[BENCH_REPETITIONS];
+    uint64_t frames = 0, instructions = 0;
+
+    for (uint32_t r = 0; r < repetitions; r++){
+        *chip8 = start;
+        const uint64_t batch_start = SDL_GetPerformanceCounter();
+        while (chip8->cycles - start.cycles < BENCH_BATCH_INSTRUCTIONS && chip8->state == RUNNING){
+            bench_frame(chip8, config);
+        }
+        const double batch_ns = (SDL_GetPerformanceCounter() - batch_start) * ns_per_tick;
+        instructions = chip8->cycles - start.cycles;
+
+        *chip8 = start;
+        for (frames = 0; frames < config.bench_frames && chip8->state == RUNNING; frames++){
+            const uint64_t frame_start = SDL_GetPerformanceCounter();
+            bench_frame(chip8, config);
+            frame_ns[frames] = (SDL_GetPerformanceCounter() - frame_start) * ns_per_tick;
+        }
+        if (!frames || !instructions) break;
+
+        ns_per_instruction[r] = batch_ns / instructions;
+        qsort(frame_ns, frames, sizeof *frame_ns, compare_doubles);
+        p50[r] = frame_ns[frames * 50 / 100] / 1000;
+        p95[r] = frame_ns[frames * 95 / 100] / 1000;
+        p99[r] = frame_ns[frames * 99 / 100] / 1000;
+        max[r] = frame_ns[frames - 1] / 1000;
+    }
+    free(frame_ns);
+    if (!frames || !instructions){
+        SDL_Log("Benchmark of %s stopped before running any timed instructions\n", chip8->rom_name);
+        return false;
+    }
+
+    double *medians[] = {ns_per_instruction, p50, p95, p99, max};
+    for (size_t i = 0; i < SDL_arraysize(medians); i++) qsort(medians[i], repetitions, sizeof *medians[i], compare_doubles);
+    bench_result_t result = {
+        .repetitions = repetitions,
+        .frames = frames,
+        .instructions = instructions,
+        .ns_per_instruction = ns_per_instruction[repetitions / 2],
+        .frame_p50_us = p50[repetitions / 2],
+        .frame_p95_us = p95[repetitions / 2],
+        .frame_p99_us = p99[repetitions / 2],
+        .frame_max_us = max[repetitions / 2],
+    };
+
+    if (gethostname(result.host, sizeof result.host - 1) != 0) strcpy(result.host, "unknown");
+    snprintf(result.compiler, sizeof result.compiler, "%s", CHIP8_COMPILER);
+    snprintf(result.commit, sizeof result.commit, "%s", CHIP8_COMMIT);
+    const char *slash = strrchr(chip8->rom_name, '/');
+    snprintf(result.rom, sizeof result.rom, "%s", slash ? slash + 1 : chip8->rom_name);
+    snprintf(result.platform, sizeof result.platform, "%s", platform_defaults[config.platform].name);
+    snprintf(result.core, sizeof result.core, "%s", core_names[config.core]);
+
+    SDL_Log("%s: median of %u runs, %.2f ns/instruction over %llu instructions, %llu frames with "
+            "frame p50 %.1f us, p95 %.1f us, p99 %.1f us, max %.1f us\n", result.rom, repetitions,
+            result.ns_per_instruction, (unsigned long long)instructions, (unsigned long long)frames,
+            result.frame_p50_us, result.frame_p95_us, result.frame_p99_us, result.frame_max_us);
+
+    // Check before appending so a baseline file can also be the history file
+    bool ok = true;
+    if (config.bench_baseline) ok = check_bench_baseline(config.bench_baseline, &result, config.bench_tolerance);
+    if (config.bench_history && !append_bench_history(config.bench_history, &result)) ok = false;
+    return ok;
+}
+
+// Microbenchmarks time one component at a time. Each one runs the given number of
+// operations and returns the performance counter ticks spent in the timed part only.
+typedef uint64_t (*microbench_fn_t)(void *arg, uint32_t iterations);
+
+#define MICROBENCH_REPETITIONS 21
+
+// Calibrate to about a millisecond per repetition, then report the spread over repetitions
+void run_microbench(const char *name, microbench_fn_t fn, void *arg){
+    const uint32_t repetitions = MICROBENCH_REPETITIONS;
+    const uint64_t target = SDL_GetPerformanceFrequency() / 1000;
+    const double ns_per_tick = 1e9 / SDL_GetPerformanceFrequency();
+
+    uint32_t iterations = 1;
+    while (iterations < (1u << 24) && fn(arg, iterations) < target) iterations *= 2;
+
+    double samples[MICROBENCH_REPETITIONS];
+    for (uint32_t i = 0; i < repetitions; i++) samples[i] = fn(arg, iterations) * ns_per_tick / iterations;
+    qsort(samples, repetitions, sizeof *samples, compare_doubles);
+
+    // Median absolute deviation, robust against the odd preempted repetition
+    const double median = samples[repetitions / 2];
+    double deviations[MICROBENCH_REPETITIONS];
+    for (uint32_t i = 0; i < repetitions; i++) deviations[i] = samples[i] > median ? samples[i] - median : median - samples[i];
+    qsort(deviations, repetitions, sizeof *deviations, compare_doubles);
+
+    SDL_Log("  %-36s %12.1f ns  min %12.1f ns  +/- %5.1f%%  (%u x %u)\n", name, median, samples[0],
+            median > 0 ? deviations[repetitions / 2] * 100 / median : 0, repetitions, iterations);
+}
+
+typedef struct{
+    chip8_t chip8;
+    config_t config;
+    core_id_t core;
+} microbench_core_t;
+
+// Straight-line interpreter work from the branch maze, which never touches the display
+uint64_t microbench_dispatch(void *arg, uint32_t iterations){
+    microbench_core_t *bench = arg;
+    const core_fn_t core = core_functions[bench->core];
+    const uint64_t start = SDL_GetPerformanceCounter();
+    for (uint32_t i = 0; i < iterations; i++) core(&bench->chip8, &bench->config);
+    return SDL_GetPerformanceCounter() - start;
+}
+
+// A single DXYN re-executed in place, positions and height come from the machine setup
+uint64_t microbench_draw(void *arg, uint32_t iterations){
+    microbench_core_t *bench = arg;
+    const core_fn_t core = core_functions[bench->core];
+    const uint64_t start = SDL_GetPerformanceCounter();
+    for (uint32_t i = 0; i < iterations; i++){
+        bench->chip8.PC = 0x200;
+        core(&bench->chip8, &bench->config);
+    }
+    return SDL_GetPerformanceCounter() - start;
+}
+
+typedef struct{
+    sdl_t sdl;
+    config_t config;
+    chip8_t *chip8;
+} microbench_screen_t;
+
+uint64_t microbench_screen(void *arg, uint32_t iterations){
+    microbench_screen_t *bench = arg;
+    const uint64_t start = SDL_GetPerformanceCounter();
+    for (uint32_t i = 0; i < iterations; i++) update_screen(bench->sdl, bench->config, bench->chip8);
+    return SDL_GetPerformanceCounter() - start;
+}
+
+// Keypad presses and releases queued up front, only the drain in handle_input is timed
+uint64_t microbench_input(void *arg, uint32_t iterations){
+    static const SDL_Keycode keys[] = {SDLK_1, SDLK_q, SDLK_a, SDLK_z, SDLK_4, SDLK_r, SDLK_f, SDLK_v};
+    chip8_t *chip8 = arg;
+    uint64_t ticks = 0;
+
+    for (uint32_t done = 0; done < iterations; ){
+        const uint32_t batch = iterations - done < 1024 ? iterations - done : 1024; // Stay well inside SDL's queue
+        // Pushing is timed too, keypad_watch runs as each event is queued
+        const uint64_t start = SDL_GetPerformanceCounter();
+        for (uint32_t i = 0; i < batch; i++){
+            SDL_Event event = {.type = i & 1 ? SDL_KEYUP : SDL_KEYDOWN};
+            event.key.keysym.sym = keys[(done + i) / 2 % SDL_arraysize(keys)];
+            SDL_PushEvent(&event);
+        }
+        handle_input(chip8, NULL, NULL, true);
+        ticks += SDL_GetPerformanceCounter() - start;
+        done += batch;
+    }
+    return ticks;
+}
+
+typedef struct{
+    config_t config;
+    const char *rom_name;
+} microbench_load_t;
+
+uint64_t microbench_load(void *arg, uint32_t iterations){
+    microbench_load_t *bench = arg;
+    chip8_t *chip8 = malloc(sizeof *chip8);
+    if (!chip8) return 0;
+
+    const uint64_t start = SDL_GetPerformanceCounter();
+    for (uint32_t i = 0; i < iterations; i++){
+        memset(chip8, 0, sizeof *chip8);
+        init_chip8(chip8, bench->config, bench->rom_name);
+    }
+    const uint64_t ticks = SDL_GetPerformanceCounter() - start;
+    free(chip8);
+    return ticks;
+}
+
+// chip8 --microbench [rom]: time decode/dispatch, DXYN, update_screen, handle_input and init_chip8 in isolation
+bool run_microbenchmarks(const char *rom_name){
+    config_t config = {0};
+    if (!set_config_from_args(&config, 1, (char *[]){"chip8", NULL})) return false;
+    config.seed = 1;
+
+    static microbench_core_t core_bench; // chip8_t is big, keep it off the stack
+    char name[64];
+
+    SDL_Log("Decode and dispatch (branch maze, per instruction):\n");
+    for (core_id_t core = 0; core < CORE_COUNT; core++){
+        rom_builder_t rom = {0};
+        build_stress_branches(&rom);
+        memset(&core_bench, 0, sizeof core_bench);
+        core_bench.config = config;
+        core_bench.core = core;
+        init_chip8_from_memory(&core_bench.chip8, config, rom.code, rom.size, "branches");
+        snprintf(name, sizeof name, "dispatch [%s]", core_names[core]);
+        run_microbench(name, microbench_dispatch, &core_bench);
+    }
+
+    // Aligned, wrapping off the right edge, and running off the bottom with and without clipping
+    static const struct{ const char *name; uint8_t x, y; uint32_t quirks; } positions[] = {
+        {"aligned", 8, 8, 0},
+        {"right wrap", 60, 8, 0},
+        {"bottom wrap", 8, 28, 0},
+        {"bottom clip", 8, 28, QUIRK_CLIPPING},
+    };
+    static const uint8_t heights[] = {1, 8, 15};
+
+    SDL_Log("DXYN (per instruction):\n");
+    for (core_id_t core = 0; core < CORE_COUNT; core++){
+        for (size_t p = 0; p < SDL_arraysize(positions); p++){
+            for (size_t h = 0; h < SDL_arraysize(heights); h++){
+                const uint8_t draw[] = {0xD0, 0x10 | heights[h]};
+                memset(&core_bench, 0, sizeof core_bench);
+                core_bench.config = config;
+                core_bench.config.quirks = positions[p].quirks;
+                core_bench.core = core;
+                init_chip8_from_memory(&core_bench.chip8, config, draw, sizeof draw, "draw");
+                core_bench.chip8.V[0] = positions[p].x;
+                core_bench.chip8.V[1] = positions[p].y;
+                core_bench.chip8.I = 0; // Font data
+                snprintf(name, sizeof name, "D01%X %s [%s]", heights[h], positions[p].name, core_names[core]);
+                run_microbench(name, microbench_draw, &core_bench);
+            }
+        }
+    }
+
+    // Render into a software surface so the numbers are the conversion, not the GPU or vsync.
+    // That needs no video subsystem, so this also runs on build hosts without a display.
+    if (SDL_Init(SDL_INIT_EVENTS) != 0){
+        SDL_Log("Could not initialize SDL subsystems! %s\n", SDL_GetError());
+        return false;
+    }
+    SDL_AddEventWatch(keypad_watch, NULL);
+
+    // Half the pixels on so both colors are drawn
+    static chip8_t screen_chip8;
+    for (size_t i = 0; i < sizeof screen_chip8.display; i++) screen_chip8.display[i] = (i ^ (i / 64)) & 1;
+
+    SDL_Log("update_screen (per frame):\n");
+    static const uint32_t scales[] = {1, 4, 10, 20};
+    for (size_t i = 0; i < SDL_arraysize(scales); i++){
+        microbench_screen_t screen_bench = {.config = config, .chip8 = &screen_chip8};
+        screen_bench.config.scale_factor = scales[i];
+        SDL_Surface *surface = SDL_CreateRGBSurfaceWithFormat(0, config.window_width * scales[i],
+                                                              config.window_height * scales[i], 32,
+                                                              SDL_PIXELFORMAT_RGBA8888);
+        screen_bench.sdl.renderer = surface ? SDL_CreateSoftwareRenderer(surface) : NULL;
+        if (!screen_bench.sdl.renderer){
+            SDL_Log("Could not create a software renderer at scale %u! %s\n", scales[i], SDL_GetError());
+            SDL_FreeSurface(surface);
+            continue;
+        }
+        snprintf(name, sizeof name, "scale %u", scales[i]);
+        run_microbench(name, microbench_screen, &screen_bench);
+        SDL_DestroyRenderer(screen_bench.sdl.renderer);
+        SDL_FreeSurface(surface);
+    }
+
+    SDL_Log("keypad_watch and handle_input (per keypad event):\n");
+    static chip8_t input_chip8;
+    input_chip8.state = RUNNING;
+    run_microbench("key down/up", microbench_input, &input_chip8);
+
+    SDL_Log("init_chip8 (per load):\n");
+    if (rom_name){
+        microbench_load_t load_bench = {.config = config, .rom_name = rom_name};
+        run_microbench(rom_name, microbench_load, &load_bench);
+    }
+    else{
+        SDL_Log("  skipped, pass a ROM to time loading it\n");
+    }
+
+    SDL_Quit();
+    return true;
+}
+
+// Time from process creation to main(), from /proc (clock tick resolution), -1 if unavailable
+double exec_to_main_ms(void){
+    FILE *file = fopen("/proc/self/stat", "r");
+    if (!file) return -1;
+
+    char stat[1024];
+    const size_t len = fread(stat, 1, sizeof stat - 1, file);
+    fclose(file);
+    stat[len] = '\0';
+
+    // Skip "pid (comm)", comm may contain spaces; starttime is the 20th field after it
+    const char *p = strrchr(stat, ')');
+    unsigned long long start_ticks = 0;
+    for (int field = 0; p && field < 20; field++) p = strchr(p + 1, ' ');
+    if (!p || sscanf(p + 1, "%llu", &start_ticks) != 1) return -1;
+
+    struct timespec now;
+    if (clock_gettime(CLOCK_BOOTTIME, &now) != 0) return -1;
+
+    const double ticks_per_second = sysconf(_SC_CLK_TCK);
+    const double now_ms = now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+    const double since_main_ms = (SDL_GetPerformanceCounter() - startup_times[STARTUP_MAIN]) * 1000.0 /
+                                 SDL_GetPerformanceFrequency();
+    return now_ms - start_ticks * 1000.0 / ticks_per_second - since_main_ms;
+}
+
+// Called after the first present, logs time to first frame and the per-stage breakdown with --startup-profile
+void report_startup(const config_t config){
+    if (!config.startup_profile) return;
+    const double ms_per_tick = 1000.0 / SDL_GetPerformanceFrequency();
+    const uint64_t main_time = startup_times[STARTUP_MAIN];
+
+    SDL_Log("Time to first frame: %.2f ms\n", (startup_times[STARTUP_FIRST_PRESENT] - main_time) * ms_per_tick);
+
+    SDL_Log("Startup profile (ms since main, ms in stage):\n");
+    const double exec_ms = exec_to_main_ms();
+    if (exec_ms >= 0) SDL_Log("  %-24s %9.2f (%ld ticks/s resolution)\n", "exec -> main", exec_ms, sysconf(_SC_CLK_TCK));
+
+    uint64_t previous = main_time;
+    for (int stage = STARTUP_MAIN + 1; stage < STARTUP_STAGE_COUNT; stage++){
+        if (!startup_times[stage]) continue; // Stage not used by this frontend
+        SDL_Log("  %-24s %9.3f %9.3f\n", startup_stage_names[stage],
+                (startup_times[stage] - main_time) * ms_per_tick, (startup_times[stage] - previous) * ms_per_tick);
+        previous = startup_times[stage];
+    }
+}
+
+// Load config.mosaic_count instances of one ROM, done before SDL so bad ROMs fail fast.
+// With a ROM pack and no ROM name, tiles cycle through every ROM in the pack.
+chip8_t *load_mosaic(const config_t config, const rom_pack_t *pack){
+    const uint32_t count = config.mosaic_count;
+    chip8_t *chip8s = calloc(count, sizeof *chip8s);
+    if (!chip8s){
+        SDL_Log("Could not allocate %u mosaic instances\n", count);
+        return NULL;
+    }
+
+    bool ok = true;
+    const rom_pack_entry_t *entry = NULL;
+    if (pack && config.rom_name){
+        entry = rom_pack_find(pack, config.rom_name);
+        if (!entry){
+            SDL_Log("ROM %s not found in ROM pack\n", config.rom_name);
+            ok = false;
+        }
+    }
+    if (ok && pack && pack->count == 0){
+        SDL_Log("ROM pack is empty\n");
+        ok = false;
+    }
+
+    for (uint32_t i = 0; ok && i < count; i++){
+        if (!pack) ok = init_chip8(&chip8s[i], config, config.rom_name);
+        else ok = init_chip8_from_pack(&chip8s[i], config, pack, entry ? entry : &pack->entries[i % pack->count]);
+    }
+
+    if (!ok){
+        free(chip8s);
+        return NULL;
+    }
+    mark_startup(STARTUP_ROM_LOAD);
+    return chip8s;
+}
+
+// Run all mosaic instances, shown in a single window
+bool run_mosaic(const sdl_t sdl, const config_t config, chip8_t chip8s[]){
+    const uint32_t count = config.mosaic_count;
+
+    mosaic_t mosaic = {0};
+    if (!init_mosaic(&mosaic, sdl, config)) return false;
+    SDL_AddEventWatch(keypad_watch, NULL);
+
+    while (chip8s[0].state != QUIT){
+        // Input drives the first instance, pause/quit apply to the whole grid
+        handle_input(&chip8s[0], NULL, NULL, true);
+        for (uint32_t i = 1; i < count; i++) chip8s[i].state = chip8s[0].state;
+        if (chip8s[0].state == RUNNING) mark_startup(STARTUP_FIRST_INSTRUCTION);
+
+        for (uint32_t i = 0; i < count; i++){
+            if (chip8s[i].state != RUNNING) continue;
+            emulate_frame(&chip8s[i], config, NULL, NULL);
+            if (chip8s[i].delay_timer > 0) chip8s[i].delay_timer--;
+            if (chip8s[i].sound_timer > 0) chip8s[i].sound_timer--;
+        }
+
+        update_mosaic(&mosaic, sdl, config, chip8s, count);
+        if (!startup_times[STARTUP_FIRST_PRESENT]){
+            mark_startup(STARTUP_FIRST_PRESENT);
+            report_startup(config);
+        }
+
+        // Delay for 60FPS (16.67 ms)
+        SDL_Delay(16);
+    }
+
+    SDL_DestroyTexture(mosaic.texture);
+    return true;
+}
+
+// Apply library settings and load every session ROM, done before SDL so bad ROMs fail fast
+bool load_sessions(session_t sessions[], const config_t config, library_t *library){
+    for (uint32_t i = 0; i < config.session_count; i++){
+        session_t *session = &sessions[i];
+        session->config = config;
+        if (!init_chip8(&session->chip8, session->config, config.session_roms[i])) return false;
+        library_apply(library, &session->chip8, &session->config);
+    }
+    mark_startup(STARTUP_ROM_LOAD);
+    return true;
+}
+
+// Emulation thread of one session, runs frames at 60hz (unthrottled when headless)
+int session_thread(void *data){
+    session_t *session = data;
+    chip8_t *chip8 = &session->chip8;
+    tune_thread("emulation", session->cpu, session->config.realtime_priority);
+    const uint64_t frequency = SDL_GetPerformanceFrequency();
+    uint64_t deadline = SDL_GetPerformanceCounter();
+
+    while (chip8->state != QUIT && SDL_AtomicGet(&session->state) != QUIT){
+        chip8->state = SDL_AtomicGet(&session->state);
+        const bool ran = chip8->state == RUNNING;
+        const uint64_t frame_start = SDL_GetPerformanceCounter();
+        if (ran){
+            const int keys = SDL_AtomicGet(&session->keypad);
+            for (uint8_t i = 0; i < 16; i++) chip8->keypad[i] = (keys >> i) & 1;
+
+            emulate_frame(chip8, session->config, NULL, NULL);
+            if (chip8->delay_timer > 0) chip8->delay_timer--;
+            if (chip8->sound_timer > 0) chip8->sound_timer--;
+            SDL_AtomicSet(&session->sounding, chip8->sound_timer > 0);
+
+            SDL_AtomicLock(&session->display_lock);
+            memcpy(session->display, chip8->display, sizeof session->display);
+            SDL_AtomicUnlock(&session->display_lock);
+        }
+        const uint64_t frame_end = SDL_GetPerformanceCounter();
+
+        // A session that fell behind starts over from now rather than running frames back to back
+        uint64_t skipped = 0;
+        if (session->config.display != DISPLAY_NONE){
+            deadline += frequency / 60;
+            if (frame_end >= deadline){
+                skipped = (frame_end - deadline) / (frequency / 60);
+                deadline = frame_end;
+            }
+            else{
+                SDL_Delay((uint32_t)((deadline - frame_end) * 1000 / frequency));
+            }
+        }
+        if (ran){
+            record_frame_metrics(&session->metrics, chip8, (double)(frame_end - frame_start) / frequency,
+                                 session->config.display != DISPLAY_NONE, skipped);
+        }
+    }
+
+    SDL_AtomicSet(&session->sounding, 0);
+    SDL_AtomicSet(&session->finished, 1);
+    return 0;
+}
+
+// What session input goes to, shared by the frame loop and session_keypad_watch
+typedef struct{
+    session_t *sessions;
+    uint32_t count;
+    bool tiled;
+    SDL_atomic_t active; // Tile taking input when tiled, TAB moves it
+} session_input_t;
+
+// Session a keyboard or window event is meant for, by window or the active tile. NULL if none
+session_t *session_for_window(session_input_t *input, const uint32_t window_id){
+    if (input->tiled) return &input->sessions[SDL_AtomicGet(&input->active)];
+    for (uint32_t i = 0; i < input->count; i++){
+        session_t *session = &input->sessions[i];
+        if (session->sdl.window && SDL_GetWindowID(session->sdl.window) == window_id) return session;
+    }
+    return NULL;
+}
+
+// Event watch putting keypad keys straight into the session's keypad mask
+int session_keypad_watch(void *userdata, SDL_Event *event){
+    if (event->type != SDL_KEYDOWN && event->type != SDL_KEYUP) return 0;
+    const int key = keypad_index(event->key.keysym.sym);
+    session_t *session = key >= 0 ? session_for_window(userdata, event->key.windowID) : NULL;
+    if (session) update_keypad_mask(&session->keypad, key, event->type == SDL_KEYDOWN);
+    return 0;
+}
+
+// Hotkeys and window events for the sessions, keypad keys were already routed by session_keypad_watch.
+// Keys go to the focused window's session, or with tiles to the active one. Returns false to quit everything
+bool handle_session_input(session_input_t *input){
+    SDL_Event event;
+    session_t *session;
+    uint32_t active;
+
+    while (SDL_PollEvent(&event)){
+        switch (event.type){
+        case SDL_QUIT:
+            return false;
+        case SDL_WINDOWEVENT:
+            // Closing one window ends that session only
+            if (event.window.event != SDL_WINDOWEVENT_CLOSE) break;
+            if (input->tiled) return false;
+            session = session_for_window(input, event.window.windowID);
+            if (session) SDL_AtomicSet(&session->state, QUIT);
+            break;
+        case SDL_KEYDOWN:
+            session = session_for_window(input, event.key.windowID);
+            if (!session) break;
+
+            switch (event.key.keysym.sym){
+                case SDLK_ESCAPE:
+                    return false;
+                case SDLK_SPACE:
+                    if (SDL_AtomicCAS(&session->state, RUNNING, PAUSED)){
+                        log_event("==== PAUSED %s ====\n", session->chip8.rom_name, 0, 0, 0);
+                    }
+                    else if (SDL_AtomicCAS(&session->state, PAUSED, RUNNING)){
+                        log_event("==== RUNNING %s ====\n", session->chip8.rom_name, 0, 0, 0);
+                    }
+                    break;
+                case SDLK_TAB:
+                    if (!input->tiled) break;
+                    // Release held keys so they don't stick on the tile being left
+                    active = SDL_AtomicGet(&input->active);
+                    SDL_AtomicSet(&input->sessions[active].keypad, 0);
+                    active = (active + 1) % input->count;
+                    SDL_AtomicSet(&input->active, active);
+                    log_event("Input to %s (session %lld)\n", input->sessions[active].chip8.rom_name, active + 1, 0, 0);
+                    break;
+                default:
+                    break;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    return true;
+}
+
+// Run config.session_count loaded sessions side by side until all of them have quit. One SDL
+// init and one audio device are shared, the mixer plays the tone of every sounding session
+bool run_sessions(session_t sessions[], const config_t config){
+    const uint32_t count = config.session_count;
+    const bool tiled = config.session_tiles && config.display == DISPLAY_SDL;
+    static chip8_t views[SESSION_MAX]; // Display copies drawn by the main thread
+    static mixer_t mixer;
+    sdl_t sdl = {0}; // Tiled window if any, and the audio device
+    mosaic_t mosaic = {0};
+    bool ok = true;
+
+    config_t tile_config = config;
+    tile_config.display = tiled ? DISPLAY_MOSAIC : DISPLAY_NONE; // No shared window unless tiled
+    tile_config.mosaic_count = count;
+    if (!init_sdl(&sdl, tile_config) || (tiled && !init_mosaic(&mosaic, sdl, tile_config))) ok = false;
+
+    // SDL is already up, init_sdl only adds the window and renderer of each session
+    for (uint32_t i = 0; ok && !tiled && config.display == DISPLAY_SDL && i < count; i++){
+        ok = init_sdl(&sessions[i].sdl, sessions[i].config);
+        if (ok) SDL_SetWindowTitle(sessions[i].sdl.window, sessions[i].chip8.rom_name);
+    }
+
+    mixer.count = 0;
+    mixer.config = &config;
+    for (uint32_t i = 0; i < count; i++){
+        mixer_add_channel(&mixer, &sessions[i].sounding, &sessions[i].config, config.session_gain[i] * 32768 / 100);
+    }
+
+    for (uint32_t i = 0; ok && i < count; i++){
+        sessions[i].cpu = config.pin_emulation_count ? config.pin_emulation[i % config.pin_emulation_count] : -1;
+        SDL_AtomicSet(&sessions[i].state, RUNNING);
+        sessions[i].thread = SDL_CreateThread(session_thread, "chip8 session", &sessions[i]);
+        if (!sessions[i].thread){
+            SDL_Log("Could not start session thread %s\n", SDL_GetError());
+            ok = false;
+        }
+    }
+    if (ok) mark_startup(STARTUP_FIRST_INSTRUCTION);
+
+    metrics_server_t metrics = {.fd = -1};
+    if (ok && config.metrics_path){
+        instance_metrics_t *instances[SESSION_MAX];
+        for (uint32_t i = 0; i < count; i++) instances[i] = &sessions[i].metrics;
+        ok = start_metrics(&metrics, config.metrics_path, instances, count);
+    }
+
+    // Session threads pinned themselves, the main thread renders and is pinned once they exist
+    tune_thread("render", config.pin_render, 0);
+
+    session_input_t input = {.sessions = sessions, .count = count, .tiled = tiled};
+    SDL_AddEventWatch(session_keypad_watch, &input);
+    const uint64_t frequency = SDL_GetPerformanceFrequency();
+    uint64_t next_present = SDL_GetPerformanceCounter();
+    uint32_t live = ok ? count : 0;
+    while (live){
+        const bool quit = !handle_session_input(&input);
+
+        // Emulation runs on the session threads, so the main thread keeps pumping events until the next
+        // present: waking on each event lets the keypad watch hand keys over as they arrive, not per frame
+        const uint64_t now = SDL_GetPerformanceCounter();
+        if (!quit && now < next_present){
+            SDL_WaitEventTimeout(NULL, (int)(((next_present - now) * 1000 + frequency - 1) / frequency));
+            continue;
+        }
+        next_present = now + frequency / 60;
+
+        live = 0;
+        bool sounding = false;
+        for (uint32_t i = 0; i < count; i++){
+            session_t *session = &sessions[i];
+            if (quit) SDL_AtomicSet(&session->state, QUIT);
+
+            if (SDL_AtomicGet(&session->finished)){
+                // Close the window of a session that ended on its own
+                if (session->sdl.window) close_window(&session->sdl);
+                continue;
+            }
+            live++;
+            sounding |= SDL_AtomicGet(&session->sounding);
+
+            SDL_AtomicLock(&session->display_lock);
+            memcpy(views[i].display, session->display, sizeof views[i].display);
+            SDL_AtomicUnlock(&session->display_lock);
+            if (session->sdl.window) update_screen(session->sdl, session->config, &views[i]);
+        }
+        if (tiled) update_mosaic(&mosaic, sdl, tile_config, views, count);
+
+        if (config.display == DISPLAY_SDL && !startup_times[STARTUP_FIRST_PRESENT]){
+            mark_startup(STARTUP_FIRST_PRESENT);
+            report_startup(config);
+        }
+
+        if (sounding && config.display == DISPLAY_SDL && init_audio(&sdl, &config, mixer_callback, &mixer)) SDL_PauseAudioDevice(sdl.dev, 0);
+        else if (!sounding && sdl.dev) SDL_PauseAudioDevice(sdl.dev, 1);
+    }
+
+    for (uint32_t i = 0; i < count; i++){
+        SDL_AtomicSet(&sessions[i].state, QUIT);
+        if (sessions[i].thread) SDL_WaitThread(sessions[i].thread, NULL);
+        if (sessions[i].sdl.window) close_window(&sessions[i].sdl);
+    }
+    SDL_DelEventWatch(session_keypad_watch, &input);
+    stop_metrics(&metrics);
+    if (mosaic.texture) SDL_DestroyTexture(mosaic.texture);
+    final_cleanup(sdl);
+    return ok;
+}
+
+int main(int argc, char **argv){
+    mark_startup(STARTUP_MAIN);
+
+    // Archive ROMs into a pack: chip8 --make-pack <pack> <roms...>
+    if (argc >= 3 && strcmp(argv[1], "--make-pack") == 0){
+        exit(write_rom_pack(argv[2], &argv[3], argc - 3) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    // Time components in isolation: chip8 --microbench [rom]
+    if (argc >= 2 && strcmp(argv[1], "--microbench") == 0){
+        exit(run_microbenchmarks(argc >= 3 ? argv[2] : NULL) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    // Generate benchmark workloads: chip8 --make-stress <dir>
+    if (argc >= 3 && strcmp(argv[1], "--make-stress") == 0){
+        exit(write_stress_roms(argv[2]) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    // Initialize emulator config
+    config_t config = {0};  
+    if (!set_config_from_args(&config, argc, argv)) exit(EXIT_FAILURE);
+    mark_startup(STARTUP_ARGS);
+
+    // Runtime messages go through the async log from here on
+    start_log();
+    save_process_affinity();
+
+    // Per-ROM settings come from the library index once the ROM is loaded, a library without a ROM just refreshes the index
+    library_t library = {0};
+    if (config.library_dir){
+        if (!open_library(&library, config.library_dir)) exit(EXIT_FAILURE);
+        if (!config.rom_name && !config.session_count){
+            close_library(&library);
+            exit(EXIT_SUCCESS);
+        }
+    }
+
+    // Several ROMs side by side, each session gets its own thread and library settings
+    if (config.session_count){
+        if (config.rom_name || config.pack_path || config.display == DISPLAY_TERMINAL || config.display == DISPLAY_MOSAIC ||
+            config.record_path || config.replay_path || config.hash_path || config.verify_path || config.resume ||
+            config.lockstep || config.netplay_path || config.bench_frames || config.profile_hz){
+            SDL_Log("--session takes every ROM itself and only runs in windows, tiles or headless\n");
+            exit(EXIT_FAILURE);
+        }
+        static session_t sessions[SESSION_MAX];
+        const bool ok = load_sessions(sessions, config, &library) && run_sessions(sessions, config);
+        close_library(&library);
+        exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    // ROM pack lookups happen once here, instances copy images straight out of the mapping
+    rom_pack_t pack = {0};
+    const rom_pack_entry_t *pack_entry = NULL;
+    if (config.pack_path){
+        if (!open_rom_pack(&pack, config.pack_path)) exit(EXIT_FAILURE);
+        if (config.rom_name && !(pack_entry = rom_pack_find(&pack, config.rom_name))){
+            SDL_Log("ROM %s not found in ROM pack %s\n", config.rom_name, config.pack_path);
+            exit(EXIT_FAILURE);
+        }
+    }
+    // A replay brings its own platform, quirks, speed and seed
+    if (config.hash_path && config.verify_path){
+        SDL_Log("--hash-stream and --verify-stream can't be used together\n");
+        exit(EXIT_FAILURE);
+    }
+    // Netplay rolls frames back and runs them again, which a hash stream has no way to follow
+    if (config.netplay_path && (config.record_path || config.replay_path || config.resume || config.lockstep ||
+                                config.hash_path || config.verify_path)){
+        SDL_Log("Netplay can't be combined with replays, hash streams, --resume or --lockstep\n");
+        exit(EXIT_FAILURE);
+    }
+    if ((config.record_path || config.replay_path) && config.resume){
+        SDL_Log("Replays start from a fresh machine and can't be combined with --resume\n");
+        exit(EXIT_FAILURE);
+    }
+    replay_t replay = {0};
+    if (config.replay_path && !open_replay(&replay, config.replay_path, &config)) exit(EXIT_FAILURE);
+
+    if (!config.rom_name && !(pack.count && config.display == DISPLAY_MOSAIC)){
+        SDL_Log("Usage: %s <rom> [options]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // Load and validate ROMs before any SDL subsystem comes up, so a bad ROM never opens a window
+    if (config.display == DISPLAY_MOSAIC){
+        chip8_t *chip8s = load_mosaic(config, config.pack_path ? &pack : NULL);
+        if (chip8s && (!config.pack_path || config.rom_name)) library_apply(&library, &chip8s[0], &config);
+        sdl_t sdl = {0};
+        const bool ok = chip8s && init_sdl(&sdl, config) && run_mosaic(sdl, config, chip8s);
+        free(chip8s);
+        close_rom_pack(&pack);
+        close_library(&library);
+        final_cleanup(sdl);
+        exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    // Initialize CHIP8 machine
+    chip8_t chip8 = {0};
+    if (pack_entry){
+        if (!init_chip8_from_pack(&chip8, config, &pack, pack_entry)) exit(EXIT_FAILURE);
+    }
+    else if (!init_chip8(&chip8, config, config.rom_name)) exit(EXIT_FAILURE);
+    const config_t startup_config = config; // Settings before the library, every hot swapped ROM starts from these
+    if (!replay.data) library_apply(&library, &chip8, &config);
+
+    if (replay.data && replay.header.rom_hash != chip8.rom_hash){
+        SDL_Log("Replay %s was recorded on a different ROM\n", config.replay_path);
+        exit(EXIT_FAILURE);
+    }
+
+    // Benchmarks run headless straight after loading, SDL is never brought up
+    if (config.bench_frames){
+        const bool ok = run_benchmark(&chip8, config);
+        close_replay(&replay);
+        close_rom_pack(&pack);
+        close_library(&library);
+        exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    // Pick up where the last session left off, netplay and --resume never run together
+    slots_t slots = {0};
+    if (config.resume && open_slots(&slots, &chip8) && load_slot(&slots.file->session, &chip8)){
+        SDL_Log("Resumed last session\n");
+    }
+    mark_startup(STARTUP_ROM_LOAD);
+
+    // Both players start from the same machine, so this comes before anything that could change it.
+    // Blocks until the peer connects, which gets its own startup stage
+    static netplay_t net = {.fd = -1}; // Snapshot history is large, keep it off the stack
+    if (config.netplay_path){
+        if (!open_netplay(&net, &config, &chip8)) exit(EXIT_FAILURE);
+        mark_startup(STARTUP_NETPLAY);
+    }
+
+    // Initialize SDL
+    sdl_t sdl = {0};
+    if (!init_sdl(&sdl, config)) exit(EXIT_FAILURE);
+    SDL_AddEventWatch(keypad_watch, NULL);
+
+    // Initialize screen clear to background color
+    term_t term;
+    if (config.display == DISPLAY_TERMINAL) init_terminal(&term);
+    else if (config.display == DISPLAY_SDL) clear_screen(sdl, config);
+
+    // Guest PC sampling, reported on exit
+    profiler_t profiler = {0};
+    if (config.profile_hz && !start_profiler(&profiler, &chip8, config.profile_hz)) exit(EXIT_FAILURE);
+
+    // Prometheus endpoint, frame times are measured from the end of one frame delay to the next present
+    static instance_metrics_t metrics;
+    instance_metrics_t *instances[] = {&metrics};
+    metrics_server_t metrics_server = {.fd = -1};
+    if (config.metrics_path && !start_metrics(&metrics_server, config.metrics_path, instances, 1)) exit(EXIT_FAILURE);
+    uint64_t frame_start = SDL_GetPerformanceCounter();
+    uint64_t last_present = frame_start;
+
+    // Second machine run by the lockstep core, cloned from the first every frame
+    chip8_t *shadow = NULL;
+    bool lockstep_ok = true;
+    if (config.lockstep){
+        shadow = malloc(sizeof *shadow);
+        if (!shadow) exit(EXIT_FAILURE);
+        SDL_Log("Running cores %s and %s in lockstep\n", core_names[config.core], core_names[config.lockstep_core]);
+    }
+
+    // Per-frame state hashes, written out or checked against a reference run
+    hash_stream_t stream = {0};
+    if (config.hash_path && !open_hash_stream(&stream, config.hash_path, &chip8, config)) exit(EXIT_FAILURE);
+    if (config.verify_path && !open_reference_stream(&stream, config.verify_path, &chip8)) exit(EXIT_FAILURE);
+    hash_stream_t *active_stream = stream.out || stream.map ? &stream : NULL;
+
+    // The main thread both emulates and renders, pinned after the helper threads above have started
+    // so they don't inherit it. An emulation CPU wins over a render CPU
+    tune_thread("emulation", config.pin_emulation_count ? config.pin_emulation[0] : config.pin_render,
+                config.realtime_priority);
+
+    // Started last so no setup failure leaves a replay without its final header
+    if (config.record_path && !start_recording(&replay, config.record_path, &chip8, config)) exit(EXIT_FAILURE);
+
+    // Main emulator loop: run instructions up to the next scheduled event, then handle what's due
+    rom_loader_t loader = {0};
+    if (pack_entry){
+        loader.image = &pack.data[pack_entry->offset];
+        loader.image_size = pack_entry->size;
+    }
+    const bool frame_mode = net.fd >= 0 || shadow;
+    scheduler_t sched;
+    reset_schedule(&sched, &chip8, &config, &replay, frame_mode, config.resume);
+
+    while (chip8.state != QUIT){
+        // A stopped machine or a frame at a time mode doesn't advance cycles between frames
+        if (chip8.state != RUNNING || frame_mode) schedule_event(&sched, EVENT_FRAME, chip8.cycles);
+
+        const uint64_t next_event = next_event_cycle(&sched, chip8.cycles);
+        if (chip8.state == RUNNING && chip8.cycles < next_event){
+            mark_startup(STARTUP_FIRST_INSTRUCTION);
+            run_instructions(&chip8, config, next_event, active_stream);
+
+            // Waiting for vblank after a draw ends the frame early
+            if (chip8.draw && (config.quirks & QUIRK_DISPLAY_WAIT)) schedule_event(&sched, EVENT_FRAME, chip8.cycles);
+        }
+
+        event_type_t event;
+        while (chip8.state != QUIT && (event = pop_due_event(&sched, chip8.cycles)) != EVENT_COUNT){
+            switch (event){
+                case EVENT_REPLAY_INPUT:
+                    apply_replay(&replay, &chip8);
+                    if (replay.has_next) schedule_event(&sched, EVENT_REPLAY_INPUT, replay.next_cycle);
+                    break;
+
+                case EVENT_REPLAY_END:
+                    chip8.state = QUIT;
+                    break;
+
+                case EVENT_AUTOSAVE:
+                    // It's a copy into the mapping
+                    if (slots.file) save_slot(&slots.file->session, &chip8);
+                    schedule_event(&sched, EVENT_AUTOSAVE, chip8.cycles + config.insts_per_second);
+                    break;
+
+                case EVENT_FRAME: {
+                    bool frame_ran = chip8.state == RUNNING;
+                    if (frame_ran && net.fd >= 0){
+                        mark_startup(STARTUP_FIRST_INSTRUCTION);
+                        frame_ran = netplay_frame(&net, &chip8, config);
+                    }
+                    else if (frame_ran && shadow){
+                        // Both machines match at every frame boundary, so re-cloning picks up input,
+                        // timers, state loads and ROM swaps without checking each one
+                        mark_startup(STARTUP_FIRST_INSTRUCTION);
+                        *shadow = chip8;
+                        lockstep_ok = emulate_frame_lockstep(&chip8, shadow, config, &replay, active_stream);
+                    }
+                    else if (frame_ran && active_stream){
+                        if (!active_stream->header.per_instruction) hash_stream_step(active_stream, &chip8);
+                        active_stream->frame++;
+                    }
+
+                    // Update window with changes, presenting before the frame delay so the first frame isn't held back
+                    if (config.display == DISPLAY_TERMINAL) update_terminal(&term, &chip8);
+                    else if (config.display == DISPLAY_SDL) update_screen(sdl, config, &chip8);
+                    chip8.draw = false;
+
+                    if (!startup_times[STARTUP_FIRST_PRESENT]){
+                        mark_startup(STARTUP_FIRST_PRESENT);
+                        report_startup(config);
+                    }
+
+                    if (config.metrics_path && frame_ran){
+                        // A present is due one 60hz period after the previous one, whole periods past that were skipped
+                        const uint64_t frequency = SDL_GetPerformanceFrequency();
+                        const uint64_t frame_end = SDL_GetPerformanceCounter();
+                        const uint64_t deadline = last_present + frequency / 60;
+                        uint64_t skipped = 0;
+                        if (config.display != DISPLAY_NONE && frame_end >= deadline){
+                            skipped = (frame_end - deadline) / (frequency / 60);
+                        }
+                        record_frame_metrics(&metrics, &chip8, (double)(frame_end - frame_start) / frequency,
+                                             config.display != DISPLAY_NONE, skipped);
+                        last_present = frame_end;
+                    }
+                    else{
+                        // Paused frames present nothing, so the next deadline counts from now
+                        last_present = SDL_GetPerformanceCounter();
+                    }
+
+                    // Delay for 60FPS (16.67 ms), headless runs as fast as it can
+                    if (config.display != DISPLAY_NONE) SDL_Delay(16);
+                    frame_start = SDL_GetPerformanceCounter();
+
+                    // Update delay & sound timers every 60hz, this also gates the square wave
+                    if (frame_ran && chip8.state == RUNNING) update_timers(&sdl, &config, &chip8);
+
+                    // Handle user input, the keypad belongs to the replay while one plays and ROMs can't be swapped.
+                    // In netplay input goes to the local player's keys, netplay_frame builds the machine's keypad.
+                    const uint64_t cycles = chip8.cycles;
+                    bool keypad[16];
+                    memcpy(keypad, chip8.keypad, sizeof keypad);
+                    if (net.fd >= 0) memcpy(chip8.keypad, net.keypad, sizeof keypad);
+                    // Loads would move cycles under a recording or replay without being recorded, and in
+                    // netplay they would only rewind this peer's machine, which rollback can't repair
+                    handle_input(&chip8, replay.data || replay.out || net.fd >= 0 ? NULL : &loader,
+                                 net.fd >= 0 ? NULL : &slots, !replay.data && !replay.out && net.fd < 0);
+                    if (net.fd >= 0) memcpy(net.keypad, chip8.keypad, sizeof keypad);
+                    if (replay.data || net.fd >= 0) memcpy(chip8.keypad, keypad, sizeof keypad);
+                    if (replay.out) record_input(&replay, &chip8);
+
+                    // Swap in a hot-loaded ROM once it is ready, saving the outgoing ROM's session first
+                    if (config.resume && slots.file && SDL_AtomicGet(&loader.state) == LOADER_DONE && loader.result){
+                        save_slot(&slots.file->session, &chip8);
+                    }
+                    if (update_rom_loader(&loader, &chip8, config)){
+                        log_event("Loaded ROM %s\n", chip8.rom_name, 0, 0, 0);
+                        // The audio callback reads config, so the new ROM's settings are copied in with it locked out
+                        config_t rom_config = startup_config;
+                        library_apply(&library, &chip8, &rom_config);
+                        if (sdl.dev) SDL_LockAudioDevice(sdl.dev);
+                        config = rom_config;
+                        if (sdl.dev) SDL_UnlockAudioDevice(sdl.dev);
+
+                        // Slots belong to the old ROM, the new one resumes its own last session
+                        close_slots(&slots);
+                        if (config.resume && open_slots(&slots, &chip8) && load_slot(&slots.file->session, &chip8)){
+                            log_event("Resumed last session\n", NULL, 0, 0, 0);
+                        }
+                        if (config.display == DISPLAY_SDL) clear_screen(sdl, config);
+                    }
+
+                    // State loads and ROM swaps move the cycle count, everything is rescheduled from there
+                    if (chip8.cycles != cycles) reset_schedule(&sched, &chip8, &config, &replay, frame_mode, config.resume);
+                    else schedule_event(&sched, EVENT_FRAME, chip8.cycles + config.insts_per_second / 60);
+                    break;
+                }
+
+                default:
+                    break;
+            }
+        }
     }
+    if (slots.file && config.resume) save_slot(&slots.file->session, &chip8);
+    if (replay.out) stop_recording(&replay, &chip8);
+    close_replay(&replay);
+    const bool stream_ok = close_hash_stream(&stream);
+    stop_profiler(&profiler);
+    stop_metrics(&metrics_server);
+    close_netplay(&net);
+    free(shadow);
     
+    if (config.display == DISPLAY_TERMINAL) close_terminal();
+    destroy_rom_loader(&loader);
+    close_slots(&slots);
+    close_rom_pack(&pack);
+    close_library(&library);
     final_cleanup(sdl);
     
-    exit(EXIT_SUCCESS);
+    exit(stream_ok && lockstep_ok ? EXIT_SUCCESS : EXIT_FAILURE);
 }
\ No newline at end of file